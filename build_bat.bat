@@ -1 +1,2 @@
-cl /EHsc /std:c++17 /I . /I ..\glfw-3.3.6\install\include /I ..\..\libtorch\include\torch\csrc\api\include /I ..\..\libtorch\include glad_gl.c gym_gl.cpp gym_torch.cpp /DYNAMICBASE ..\glfw-3.3.6\install\lib\glfw3dll.lib /DYNAMICBASE ..\..\libtorch\lib\c10.lib /DYNAMICBASE ..\..\libtorch\lib\torch.lib /DYNAMICBASE ..\..\libtorch\lib\torch_cpu.lib /link /out:build\gym.exe
\ No newline at end of file
+cl /EHsc /std:c++17 /I . /I ..\glfw-3.3.6\install\include /I ..\..\libtorch\include\torch\csrc\api\include /I ..\..\libtorch\include glad_gl.c gym_gl.cpp gym_torch.cpp gym_simd.cpp gym_simd_avx2.cpp gym_simd_avx512.cpp gym_vector_env.cpp gym_subproc.cpp gym_queue.cpp gym_threads.cpp /DYNAMICBASE ..\glfw-3.3.6\install\lib\glfw3dll.lib /DYNAMICBASE ..\..\libtorch\lib\c10.lib /DYNAMICBASE ..\..\libtorch\lib\torch.lib /DYNAMICBASE ..\..\libtorch\lib\torch_cpu.lib /link /out:build\gym.exe
+cl /EHsc /std:c++17 /O2 /I . /I ..\..\libtorch\include\torch\csrc\api\include /I ..\..\libtorch\include gym_bench.cpp gym_torch.cpp gym_simd.cpp gym_simd_avx2.cpp gym_simd_avx512.cpp gym_vector_env.cpp gym_subproc.cpp gym_queue.cpp gym_threads.cpp /DYNAMICBASE ..\..\libtorch\lib\c10.lib /DYNAMICBASE ..\..\libtorch\lib\torch.lib /DYNAMICBASE ..\..\libtorch\lib\torch_cpu.lib /link /out:build\gym_bench.exe
\ No newline at end of file
@@ -0,0 +1,1073 @@
+/**
+ * Throughput benchmarks for the Gym environments.
+ * Usage: gym_bench [envs]
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "gym_torch.h"
+#include "gym_queue.h"
+#include "gym_simd.h"
+#include "gym_subproc.h"
+#include "gym_threads.h"
+#include "gym_vector_env.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point t0)
+{
+    return std::chrono::duration<double>(Clock::now() - t0).count();
+}
+
+//Every operator new of the process is counted. Tensor storage comes from
+//the c10 allocator, but each tensor also news its TensorImpl, so a step that
+//creates tensors shows up here.
+static std::atomic<long long> gNewCount{0};
+
+void* operator new(std::size_t size)
+{
+    ++gNewCount;
+    if ( void *p = std::malloc(size ? size : 1) ) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+/**
+ * Env-steps/sec of the cart-pole kernel on scalar type T for every
+ * instruction set the CPU supports and every sin/cos mode, once on raw lanes
+ * and once through CartPole_BatchT<T>::step().
+ */
+template<typename T>
+static void bench_cartpole_isa(int envs)
+{
+    const int steps = 1000;
+    const Gym_ISA isas[] = {Gym_ISA::Scalar, Gym_ISA::AVX2, Gym_ISA::AVX512};
+    const Sincos_Mode modes[] = {Sincos_Mode::Libm, Sincos_Mode::Fast, Sincos_Mode::Precise};
+    CartPole_Physics physics;
+
+    printf("== CartPole kernel (%s), %d envs x %d steps ==\n",
+           sizeof(T) == sizeof(float) ? "float" : "double", envs, steps);
+    printf("%-8s %-8s %16s %16s\n", "isa", "sincos", "kernel steps/s", "step() steps/s");
+
+    for ( auto isa : isas ) {
+        if ( !gym_isa_supported(isa) ) {
+            printf("%-8s %-8s %16s %16s\n", gym_isa_name(isa), "", "n/a", "n/a");
+            continue;
+        }
+        for ( auto mode : modes ) {
+            const int n = gym_pad_lanes(envs);
+            std::vector<T> x(n, T(0.01)), x_dot(n, T(0)), theta(n, T(0.02)), theta_dot(n, T(0));
+            std::vector<T> force(n, T(0));
+            std::vector<uint8_t> done(n, 0);
+            CartPole_Lanes<T> lanes{x.data(), x_dot.data(), theta.data(), theta_dot.data(),
+                                    force.data(), done.data(), n};
+            auto kernel = cartpole_kernel<T>(isa, physics.kinematics_integrator, mode);
+
+            auto t0 = Clock::now();
+            for ( int s=0; s<steps; ++s ) {
+                kernel(physics, lanes);
+            }
+            const double kernelRate = double(envs) * steps / seconds_since(t0);
+
+            CartPole_BatchT<T> gym(envs);
+            gym.set_isa(isa);
+            gym.set_sincos_mode(mode);
+            gym.reset();
+            auto action = torch::zeros({envs, gym.action_dimension()});
+
+            t0 = Clock::now();
+            for ( int s=0; s<steps; ++s ) {
+                gym.step(action);
+            }
+            const double stepRate = double(envs) * steps / seconds_since(t0);
+
+            printf("%-8s %-8s %16.3e %16.3e\n", gym_isa_name(isa), gym_sincos_name(mode),
+                   kernelRate, stepRate);
+        }
+    }
+}
+
+/** Heap allocations and time per step() and per step_into() once running; false when step_into allocates */
+static bool bench_step_into(int envs)
+{
+    const int warmup = 100;
+    const int steps = 10000;
+    bool ok = true;
+
+    printf("== step() vs step_into(), %d steps ==\n", steps);
+    printf("%-24s %-10s %12s %12s\n", "env", "call", "news/step", "us/step");
+
+    //n = 0 for a single env. Single envs are reset when done (included in
+    //the timing, not in news/step), the batch restarts finished envs on its
+    //own. step_into must not allocate at all.
+    auto run = [&](const char *name, Gym_Torch &gym, int n) {
+        const auto dbl = torch::TensorOptions().dtype(torch::kDouble);
+        const auto i32 = torch::TensorOptions().dtype(torch::kInt);
+        auto action = n ? torch::zeros({n, gym.action_dimension()}) : torch::zeros({gym.action_dimension()});
+        auto state = n ? torch::zeros({n, gym.state_dimension()}, dbl) : torch::zeros({gym.state_dimension()}, dbl);
+        auto reward = torch::zeros({n ? n : 1});
+        auto done = torch::zeros({n ? n : 1}, i32);
+        const int *pDone = done.data_ptr<int>();
+
+        for ( int pass=0; pass<2; ++pass ) {
+            long long news = 0;
+            Clock::time_point t0;
+            gym.reset();
+            for ( int s=0; s<warmup+steps; ++s ) {
+                if ( s == warmup ) {
+                    news = 0;
+                    t0 = Clock::now();
+                }
+                const long long news0 = gNewCount;
+                if ( pass ) {
+                    gym.step_into(action, state, reward, done);
+                } else {
+                    done.copy_(std::get<2>(gym.step(action)));
+                }
+                news += gNewCount - news0;
+                if ( !n && *pDone ) {
+                    gym.reset();
+                }
+            }
+            const double us = 1e6 * seconds_since(t0) / steps;
+            const bool allocates = pass && 0 < news;
+            printf("%-24s %-10s %12.2f %12.3f%s\n", name, pass ? "step_into" : "step",
+                   double(news) / steps, us, allocates ? "  ALLOCATES" : "");
+            ok &= !allocates;
+        }
+    };
+
+    CartPole_Continous single(true);
+    run("CartPole_Continous", single, 0);
+
+    CartPole_Batch batch(envs);
+    batch.set_auto_reset(true);
+    run("CartPole_Batch", batch, envs);
+    return ok;
+}
+
+/** Gym_VectorEnv steps per second and worker utilization against the pool size */
+static void bench_vector_env(int envs)
+{
+    const int warmup = 100;
+    const int steps = 2000;
+    const int workers[] = {1, 2, 4, int(std::max(1u, std::thread::hardware_concurrency()))};
+
+    printf("== Gym_VectorEnv, %d CartPole_Continous, %d steps ==\n", envs, steps);
+    printf("%-8s %14s   %s\n", "workers", "env-steps/s", "utilization");
+
+    for ( int w : workers ) {
+        std::vector<std::unique_ptr<Gym_Torch>> vEnvs;
+        for ( int e=0; e<envs; ++e ) {
+            vEnvs.emplace_back(new CartPole_Continous(true));
+        }
+        Gym_VectorEnv vec(std::move(vEnvs), w);
+        vec.seed(1);
+        vec.reset();
+        const auto action = torch::zeros({envs, vec.action_dimension()});
+
+        Clock::time_point t0;
+        for ( int s=0; s<warmup+steps; ++s ) {
+            if ( s == warmup ) {
+                vec.reset_utilization();
+                t0 = Clock::now();
+            }
+            const int *pDone = std::get<2>(vec.step(action)).data_ptr<int>();
+            //Finished envs are reset one by one, inside the timing
+            for ( int e=0; e<envs; ++e ) {
+                if ( pDone[e] ) {
+                    vec.env(e).reset();
+                }
+            }
+        }
+        const double rate = double(envs) * steps / seconds_since(t0);
+
+        printf("%-8d %14.3e  ", vec.worker_count(), rate);
+        for ( double u : vec.worker_utilization() ) {
+            printf(" %.2f", u);
+        }
+        printf("\n");
+    }
+}
+
+/** step() after inference against two groups overlapping inference and step_async() */
+static void bench_vector_async(int envs)
+{
+    const int steps = 1000;
+    const int workers = int(std::max(1u, std::thread::hardware_concurrency()));
+
+    std::vector<std::unique_ptr<Gym_Torch>> vEnvs;
+    for ( int e=0; e<envs; ++e ) {
+        vEnvs.emplace_back(new CartPole_Continous(true));
+    }
+    Gym_VectorEnv vec(std::move(vEnvs), workers);
+    vec.seed(1);
+    vec.reset();
+    const auto action = torch::zeros({envs, vec.action_dimension()});
+
+    //Stand-in for policy inference on the calling thread, as long as a step
+    Clock::time_point t0 = Clock::now();
+    for ( int s=0; s<100; ++s ) {
+        vec.step(action);
+    }
+    const auto stepTime = (Clock::now() - t0) / 100;
+    auto policy = [&](int n) {
+        const auto until = Clock::now() + stepTime * n / envs;
+        while ( Clock::now() < until ) {
+        }
+    };
+    auto reset_done = [&](const torch::Tensor &done, int begin) {
+        const int *pDone = done.data_ptr<int>();
+        for ( int e=0; e<done.size(0); ++e ) {
+            if ( pDone[e] ) {
+                vec.env(begin + e).reset();
+            }
+        }
+    };
+
+    printf("== Gym_VectorEnv step_async, %d envs, %d workers, %d steps ==\n", envs, vec.worker_count(), steps);
+    printf("%-24s %14s\n", "loop", "env-steps/s");
+
+    t0 = Clock::now();
+    for ( int s=0; s<steps; ++s ) {
+        policy(envs);
+        reset_done(std::get<2>(vec.step(action)), 0);
+    }
+    printf("%-24s %14.3e\n", "policy + step", double(envs) * steps / seconds_since(t0));
+
+    vec.set_groups(2);
+    const auto half0 = action.narrow(0, 0, vec.group_size(0));
+    const auto half1 = action.narrow(0, vec.group_begin(1), vec.group_size(1));
+    t0 = Clock::now();
+    policy(vec.group_size(0));
+    vec.step_async(half0, 0);
+    policy(vec.group_size(1));
+    vec.step_async(half1, 1);
+    for ( int s=1; s<steps; ++s ) {
+        reset_done(std::get<2>(vec.step_wait(0)), vec.group_begin(0));
+        policy(vec.group_size(0));
+        vec.step_async(half0, 0);
+        reset_done(std::get<2>(vec.step_wait(1)), vec.group_begin(1));
+        policy(vec.group_size(1));
+        vec.step_async(half1, 1);
+    }
+    vec.step_wait(0);
+    vec.step_wait(1);
+    printf("%-24s %14.3e\n", "2 groups, step_async", double(envs) * steps / seconds_since(t0));
+}
+
+/**
+ * CPU stand-in for the GL renderer, which needs a window: the pole of each
+ * axis as a line from the cart, depth in the top bytes.
+ */
+static Gym_Render_Callback cpu_renderer(int w, int h)
+{
+    return [w, h](Gym_Span<const double> pos, Gym_Span<const double> ang, Gym_Span<uint32_t> rgba) {
+        std::fill(rgba.begin(), rgba.end(), 0u);
+        for ( size_t a=0; a<pos.size && a<ang.size; ++a ) {
+            const double cx = (0.5 + pos[a] / 4.8) * w;
+            for ( int k=0; k<h/2; ++k ) {
+                const int px = int(cx + k * std::sin(ang[a]));
+                const int py = h - 1 - int(k * std::cos(ang[a]));
+                if ( 0 <= px && px < w && 0 <= py && py < h ) {
+                    rgba[size_t(py) * w + px] = 0xFF800000u | unsigned(a + 1) << 8;
+                }
+            }
+        }
+    };
+}
+
+/**
+ * Per-batch latency of a mixed vision/state workload on Gym_WorkerPool, with
+ * and without work stealing. The vision envs render on the CPU (a stand-in
+ * for the GL renderer, which needs a window) and sit together at the front,
+ * the worst case for static chunks.
+ */
+static void bench_work_stealing(int envs)
+{
+    const int warmup = 10;
+    const int batches = 200;
+    const int visionEnvs = std::max(1, envs / 8);
+    const int workers = int(std::max(2u, std::thread::hardware_concurrency()));
+
+    const int w = 128, h = 128;
+    Gym_Render_Callback render = cpu_renderer(w, h);
+
+    std::vector<std::unique_ptr<Gym_Torch>> vEnvs;
+    std::vector<torch::Tensor> vActions;
+    for ( int e=0; e<envs; ++e ) {
+        if ( e < visionEnvs ) {
+            auto *vision = new CartPole_ContinousVision(true);
+            vision->setRenderer(&render, w, h);
+            vEnvs.emplace_back(vision);
+        } else {
+            vEnvs.emplace_back(new CartPole_Continous(true));
+        }
+        vEnvs.back()->seed(1, uint32_t(e));
+        vEnvs.back()->reset();
+        vActions.push_back(torch::zeros({vEnvs.back()->action_dimension()}));
+    }
+    const std::function<void(int)> body = [&](int e) {
+        if ( *std::get<2>(vEnvs[e]->step(vActions[e])).data_ptr<int>() ) {
+            vEnvs[e]->reset();
+        }
+    };
+
+    printf("== Work stealing, %d envs (%d vision), %d workers, %d batches ==\n",
+           envs, visionEnvs, workers, batches);
+    printf("%-10s %12s %12s %12s %12s\n", "schedule", "p50 ms", "p99 ms", "max ms", "env-steps/s");
+
+    Gym_WorkerPool pool(workers);
+    for ( bool steal : {false, true} ) {
+        pool.set_work_stealing(steal);
+        std::vector<double> ms;
+        for ( int b=0; b<warmup+batches; ++b ) {
+            const auto t0 = Clock::now();
+            pool.run(envs, body);
+            if ( b >= warmup ) {
+                ms.push_back(1e3 * seconds_since(t0));
+            }
+        }
+        double total = 0.0;
+        for ( double t : ms ) {
+            total += t;
+        }
+        std::sort(ms.begin(), ms.end());
+        printf("%-10s %12.3f %12.3f %12.3f %12.3e\n", steal ? "stealing" : "static",
+               ms[ms.size() / 2], ms[ms.size() * 99 / 100], ms.back(),
+               double(envs) * batches / (1e-3 * total));
+    }
+}
+
+/**
+ * Frame stacking of CartPole_ContinousVision for preFramesCount 1..8: the
+ * history ring (env step, CPU render included) with float and uint8 states
+ * against the former deque of frames + torch::stack + clone on the same
+ * rendered frame, without the step.
+ */
+static void bench_frame_stack()
+{
+    const int steps = 2000;
+    const int w = 128, h = 128;
+    Gym_Render_Callback render = cpu_renderer(w, h);
+
+    //Env steps per second and allocations per step_into (resets not counted)
+    //with states of type
+    auto ring_steps = [&](int pre, torch::ScalarType type, double &allocs) {
+        CartPole_ContinousVision gym(true, pre);
+        gym.setRenderer(&render, w, h);
+        gym.set_state_type(type);
+        gym.seed(1);
+        gym.reset();
+        const auto action = torch::zeros({gym.action_dimension()});
+        const auto state = torch::empty({gym.state_dimension()}, torch::TensorOptions().dtype(type));
+        const auto reward = torch::zeros({1});
+        const auto done = torch::zeros({1}, torch::TensorOptions().dtype(torch::kInt));
+
+        long long news = 0;
+        const auto t0 = Clock::now();
+        for ( int i=0; i<steps; ++i ) {
+            const long long news0 = gNewCount.load();
+            gym.step_into(action, state, reward, done);
+            news += gNewCount.load() - news0;
+            if ( *done.data_ptr<int>() ) {
+                gym.reset();
+            }
+        }
+        const double rate = steps / seconds_since(t0);
+        allocs = double(news) / steps;
+        return rate;
+    };
+
+    printf("== Frame stack, %dx%d, %d steps ==\n", w, h, steps);
+    printf("%-8s %14s %14s %16s %12s %12s\n", "frames", "float steps/s", "uint8 steps/s",
+           "deque stacks/s", "allocs/step", "KiB f32/u8");
+    for ( int pre=1; pre<=8; ++pre ) {
+        double allocs, allocsU8;
+        const double ring = ring_steps(pre, torch::kFloat, allocs);
+        const double ringU8 = ring_steps(pre, torch::kUInt8, allocsU8);
+
+        auto frame = torch::zeros({w * h, 4}, torch::TensorOptions().dtype(torch::kInt8));
+        std::deque<torch::Tensor> history;
+        const auto t0 = Clock::now();
+        for ( int i=0; i<steps; ++i ) {
+            auto img = frame.index({torch::indexing::Slice(), torch::indexing::Slice(2, 4)}).toType(torch::kFloat);
+            std::vector<torch::Tensor> stack(history.begin(), history.end());
+            stack.resize(pre, img);
+            stack.push_back(img);
+            torch::stack(stack, 1).view({-1});
+            history.push_back(img.clone());
+            if ( int(history.size()) > pre ) {
+                history.pop_front();
+            }
+        }
+        const double legacy = steps / seconds_since(t0);
+        const double kib = w * h * 2.0 * (pre + 1) / 1024;
+        printf("%-8d %14.3e %14.3e %16.3e %12.1f %5.0f/%-6.0f\n", pre + 1, ring, ringU8, legacy,
+               std::max(allocs, allocsU8), sizeof(float) * kib, kib);
+    }
+}
+
+#if defined(__linux__)
+/** Gym_VectorEnv (threads) against Gym_SubprocVectorEnv (processes, shared memory) */
+static void bench_subproc(int envs)
+{
+    const int warmup = 100;
+    const int steps = 2000;
+    const int workers = int(std::max(1u, std::thread::hardware_concurrency()));
+
+    printf("== Threads vs processes, %d CartPole_Batch(1), %d workers, %d steps ==\n",
+           envs, workers, steps);
+    printf("%-24s %14s\n", "vector env", "env-steps/s");
+
+    auto run = [&](const char *name, Gym_Torch &vec) {
+        vec.seed(1);
+        vec.reset();
+        const auto action = torch::zeros({envs, vec.action_dimension()});
+        Clock::time_point t0;
+        for ( int s=0; s<warmup+steps; ++s ) {
+            if ( s == warmup ) {
+                t0 = Clock::now();
+            }
+            vec.step(action);
+        }
+        printf("%-24s %14.3e\n", name, double(envs) * steps / seconds_since(t0));
+    };
+
+    //The processes have no per-env reset(), fallen envs restart inside step()
+    const Gym_VectorEnv::Factory make_env = [](int) {
+        auto *env = new CartPole_Batch(1, true);
+        env->set_auto_reset(true);
+        return std::unique_ptr<Gym_Torch>(env);
+    };
+    //Forked before the pool of the threaded env exists
+    Gym_SubprocVectorEnv processes(make_env, envs, workers);
+
+    std::vector<std::unique_ptr<Gym_Torch>> vEnvs;
+    for ( int e=0; e<envs; ++e ) {
+        vEnvs.push_back(make_env(e));
+    }
+    Gym_VectorEnv threads(std::move(vEnvs), workers);
+    run("Gym_VectorEnv", threads);
+    run("Gym_SubprocVectorEnv", processes);
+}
+
+/**
+ * A Gym_SubprocVectorEnv whose processes build envs of different
+ * dimensions must throw right away, not after the workers are killed on
+ * a shutdown timeout.
+ */
+static bool bench_subproc_failure()
+{
+    const int processes = 4;
+    const auto t0 = Clock::now();
+    bool threw = false;
+    try {
+        Gym_SubprocVectorEnv vec([](int i) {
+            return std::unique_ptr<Gym_Torch>(new CartPole_Continous(0 == i));
+        }, processes, processes);
+    } catch (const std::invalid_argument &) {
+        threw = true;
+    }
+    const double sec = seconds_since(t0);
+    const bool ok = threw && sec < 1.0;
+    printf("== Subprocess env failure ==\n%-24s %10.3f s %s\n", "mismatched factories", sec,
+           ok ? "ok" : threw ? "TOO SLOW" : "DID NOT THROW");
+    return ok;
+}
+#endif
+
+/**
+ * Gym_VectorEnv with workers pinned to cores 0..W-1 (envs and buffers first
+ * touched by their worker) against unpinned workers and envs built by the
+ * main thread.
+ */
+static void bench_pinning(int envs)
+{
+    const int warmup = 100;
+    const int steps = 2000;
+    const int workers = int(std::max(1u, std::thread::hardware_concurrency()));
+
+    printf("== Pinned vs unpinned workers, %d CartPole_Continous, %d workers, %d steps ==\n",
+           envs, workers, steps);
+    printf("%-10s %14s\n", "workers", "env-steps/s");
+
+    auto run = [&](const char *name, Gym_VectorEnv &vec) {
+        vec.seed(1);
+        vec.reset();
+        const auto action = torch::zeros({envs, vec.action_dimension()});
+        Clock::time_point t0;
+        for ( int s=0; s<warmup+steps; ++s ) {
+            if ( s == warmup ) {
+                t0 = Clock::now();
+            }
+            const int *pDone = std::get<2>(vec.step(action)).data_ptr<int>();
+            for ( int e=0; e<envs; ++e ) {
+                if ( pDone[e] ) {
+                    vec.env(e).reset();
+                }
+            }
+        }
+        printf("%-10s %14.3e\n", name, double(envs) * steps / seconds_since(t0));
+    };
+
+    std::vector<std::unique_ptr<Gym_Torch>> vEnvs;
+    for ( int e=0; e<envs; ++e ) {
+        vEnvs.emplace_back(new CartPole_Continous(true));
+    }
+    Gym_VectorEnv unpinned(std::move(vEnvs), workers);
+    run("unpinned", unpinned);
+
+    std::vector<int> cores(workers);
+    for ( int w=0; w<workers; ++w ) {
+        cores[w] = w;
+    }
+    Gym_VectorEnv pinned([](int) {
+        return std::unique_ptr<Gym_Torch>(new CartPole_Continous(true));
+    }, envs, cores);
+    run("pinned", pinned);
+}
+
+/**
+ * Transitions per second from actor threads to one learner, through
+ * Gym_TransitionQueue against a mutex-protected std::vector handoff.
+ * Transitions are synthetic (8-dim state, 2-dim action) to time the
+ * handoff alone.
+ */
+static void bench_transition_queue()
+{
+    const int stateDim = 8, actionDim = 2;
+    const int perActor = 200000;
+    const int batchRows = 256;
+    const int actorCounts[] = {1, int(std::max(2u, std::thread::hardware_concurrency()))};
+
+    printf("== Transition handoff, %d per actor, batches of %d ==\n", perActor, batchRows);
+    printf("%-8s %-12s %16s\n", "actors", "handoff", "transitions/s");
+
+    for ( int actors : actorCounts ) {
+        const int total = actors * perActor;
+        {
+            Gym_TransitionQueue queue(4096, stateDim, actionDim,
+                                      1 == actors ? Gym_Producers::Single : Gym_Producers::Multi);
+            auto batch = queue.make_batch(batchRows);
+            const auto t0 = Clock::now();
+            std::vector<std::thread> vActors;
+            for ( int a=0; a<actors; ++a ) {
+                vActors.emplace_back([&queue, a, perActor, stateDim, actionDim]() {
+                    std::vector<float> s(stateDim, float(a)), act(actionDim), s2(stateDim);
+                    for ( int k=0; k<perActor; ++k ) {
+                        s2[0] = float(k);
+                        while ( !queue.try_push(s.data(), act.data(), 1.0f, s2.data(), 0) ) {
+                            std::this_thread::yield();
+                        }
+                    }
+                });
+            }
+            for ( int got=0; got<total; ) {
+                const int n = queue.pop_batch(batch);
+                if ( 0 == n ) {
+                    std::this_thread::yield();
+                }
+                got += n;
+            }
+            for ( auto &t : vActors ) {
+                t.join();
+            }
+            printf("%-8d %-12s %16.3e\n", actors, 1 == actors ? "spsc queue" : "mpsc queue",
+                   total / seconds_since(t0));
+        }
+        {
+            const int width = 2 * stateDim + actionDim + 2;
+            std::mutex mutex;
+            std::vector<float> shared;
+            std::vector<float> taken, batch(size_t(batchRows) * width);
+            const auto t0 = Clock::now();
+            std::vector<std::thread> vActors;
+            for ( int a=0; a<actors; ++a ) {
+                vActors.emplace_back([&mutex, &shared, a, perActor, width]() {
+                    std::vector<float> row(width, float(a));
+                    for ( int k=0; k<perActor; ++k ) {
+                        row[0] = float(k);
+                        std::lock_guard<std::mutex> lock(mutex);
+                        shared.insert(shared.end(), row.begin(), row.end());
+                    }
+                });
+            }
+            for ( int got=0; got<total; ) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    taken.swap(shared);
+                }
+                if ( taken.empty() ) {
+                    std::this_thread::yield();
+                }
+                const int rows = int(taken.size()) / width;
+                for ( int r=0; r<rows; r+=batchRows ) {
+                    const int n = std::min(batchRows, rows - r);
+                    std::copy(taken.begin() + size_t(r) * width, taken.begin() + size_t(r + n) * width,
+                              batch.begin());
+                }
+                got += rows;
+                taken.clear();
+            }
+            for ( auto &t : vActors ) {
+                t.join();
+            }
+            printf("%-8d %-12s %16.3e\n", actors, "mutex vector", total / seconds_since(t0));
+        }
+    }
+}
+
+/**
+ * Synchronous batches of N against first-M-of-N batches (M = N/2) when
+ * render time varies per env: the vision envs render on the CPU and one
+ * render in ten takes ten times longer.
+ */
+static void bench_first_m_of_n(int envs)
+{
+    const int batches = 200;
+    const int workers = int(std::max(2u, std::thread::hardware_concurrency()));
+    const int w = 128, h = 128;
+
+    Gym_Render_Callback render =
+        [](Gym_Span<const double>, Gym_Span<const double>, Gym_Span<uint32_t> rgba) {
+        thread_local std::mt19937 rng(std::random_device{}());
+        const auto until = Clock::now() + std::chrono::microseconds(0 == rng() % 10 ? 1000 : 100);
+        while ( Clock::now() < until ) {
+        }
+        std::fill(rgba.begin(), rgba.end(), 0u);
+    };
+
+    std::vector<std::unique_ptr<Gym_Torch>> vEnvs;
+    for ( int e=0; e<envs; ++e ) {
+        auto *vision = new CartPole_ContinousVision(true);
+        vision->setRenderer(&render, w, h);
+        vEnvs.emplace_back(vision);
+    }
+    Gym_VectorEnv vec(std::move(vEnvs), workers);
+    vec.seed(1);
+
+    printf("== First-M-of-N, %d vision envs, %d workers, %d batches ==\n", envs, workers, batches);
+    printf("%-16s %8s %12s %14s\n", "mode", "batch", "ms/batch", "env-steps/s");
+
+    auto reset_done = [&vec](const torch::Tensor &done, const torch::Tensor &ids) {
+        const int *pDone = done.data_ptr<int>();
+        for ( int k=0; k<done.size(0); ++k ) {
+            if ( pDone[k] ) {
+                vec.env(ids.defined() ? int(ids.data_ptr<int64_t>()[k]) : k).reset();
+            }
+        }
+    };
+
+    vec.reset();
+    const auto action = torch::zeros({envs, vec.action_dimension()});
+    auto t0 = Clock::now();
+    for ( int b=0; b<batches; ++b ) {
+        reset_done(std::get<2>(vec.step(action)), torch::Tensor());
+    }
+    double sec = seconds_since(t0);
+    printf("%-16s %8d %12.3f %14.3e\n", "synchronous", envs, 1e3 * sec / batches, double(envs) * batches / sec);
+
+    const int m = std::max(1, envs / 2);
+    vec.set_batch_size(m);
+    const auto half = torch::zeros({m, vec.action_dimension()});
+    vec.async_reset();
+    t0 = Clock::now();
+    for ( int b=0; b<batches; ++b ) {
+        auto [state, reward, done, ids] = vec.recv();
+        reset_done(done, ids);
+        vec.send(half, ids);
+    }
+    sec = seconds_since(t0);
+    for ( int left=envs; left>=m; left-=m ) {
+        vec.recv();
+    }
+    printf("%-16s %8d %12.3f %14.3e\n", "first-M-of-N", m, 1e3 * sec / batches, double(m) * batches / sec);
+}
+
+/**
+ * Env-steps per second of a step + MLP inference loop for each split of the
+ * cores between env workers and libtorch intra-op threads.
+ */
+static void bench_thread_budget(int envs)
+{
+    const int warmup = 20;
+    const int steps = 500;
+    const int hidden = 256;
+    const Gym_ThreadBudget budget;
+    const int intraOp0 = torch::get_num_threads();
+
+    printf("== Thread budget sweep, %d cores, %d CartPole_Continous, MLP %d, %d steps ==\n",
+           budget.core_count(), envs, hidden, steps);
+    printf("%-12s %-12s %14s\n", "env workers", "intra-op", "env-steps/s");
+
+    double bestRate = 0.0;
+    Gym_ThreadSplit best;
+    for ( const auto &split : budget.candidate_splits() ) {
+        Gym_ThreadBudget::apply(split);
+        Gym_VectorEnv vec([](int) {
+            return std::unique_ptr<Gym_Torch>(new CartPole_Continous(true));
+        }, envs, budget.env_cores(split));
+        vec.seed(1);
+        auto state = vec.reset();
+        const auto w1 = torch::randn({vec.state_dimension(), hidden});
+        const auto w2 = torch::randn({hidden, vec.action_dimension()});
+
+        Clock::time_point t0;
+        for ( int s=0; s<warmup+steps; ++s ) {
+            if ( s == warmup ) {
+                t0 = Clock::now();
+            }
+            const auto action = torch::tanh(torch::matmul(torch::tanh(torch::matmul(state, w1)), w2));
+            auto result = vec.step(action);
+            state = std::get<0>(result);
+            const int *pDone = std::get<2>(result).data_ptr<int>();
+            for ( int e=0; e<envs; ++e ) {
+                if ( pDone[e] ) {
+                    vec.env(e).reset();
+                }
+            }
+        }
+        const double rate = double(envs) * steps / seconds_since(t0);
+        printf("%-12d %-12d %14.3e\n", split.envWorkers, split.intraOpThreads, rate);
+        if ( rate > bestRate ) {
+            bestRate = rate;
+            best = split;
+        }
+    }
+    printf("best: %d env workers, %d intra-op threads\n", best.envWorkers, best.intraOpThreads);
+    torch::set_num_threads(intraOp0);
+}
+
+/**
+ * Trajectory hashes of seeded Gym_VectorEnv rollouts with 1, 4 and 32
+ * workers, synchronous (sample_action() + step()) and first-M-of-N (per env
+ * hashes, combined in env order). Returns false on any mismatch.
+ */
+static bool bench_determinism(int envs)
+{
+    const int steps = 300;
+    const int workerCounts[] = {1, 4, 32};
+    const uint64_t seed = 20240601;
+
+    auto fnv1a = [](uint64_t h, const void *p, size_t bytes) {
+        const unsigned char *c = static_cast<const unsigned char*>(p);
+        for ( size_t k=0; k<bytes; ++k ) {
+            h = (h ^ c[k]) * 1099511628211ull;
+        }
+        return h;
+    };
+    auto make = [envs](int workers) {
+        std::vector<std::unique_ptr<Gym_Torch>> vEnvs;
+        for ( int e=0; e<envs; ++e ) {
+            vEnvs.emplace_back(new CartPole_Continous(true));
+        }
+        return std::unique_ptr<Gym_VectorEnv>(new Gym_VectorEnv(std::move(vEnvs), workers));
+    };
+
+    printf("== Determinism, %d CartPole_Continous, %d steps, seed %llu ==\n",
+           envs, steps, (unsigned long long)seed);
+    printf("%-8s %-16s %-16s %s\n", "workers", "sync hash", "first-M hash", "");
+
+    uint64_t refSync = 0, refAsync = 0;
+    bool same = true;
+    for ( int workers : workerCounts ) {
+        auto vec = make(workers);
+        const int stateDim = vec->state_dimension();
+
+        //Synchronous: sampled actions, done envs reset in env order
+        vec->seed(seed);
+        vec->reset();
+        uint64_t hSync = 1469598103934665603ull;
+        for ( int s=0; s<steps; ++s ) {
+            const auto action = vec->sample_action();
+            hSync = fnv1a(hSync, action.data_ptr<float>(), sizeof(float) * action.numel());
+            auto result = vec->step(action);
+            const auto &state = std::get<0>(result);
+            const int *pDone = std::get<2>(result).data_ptr<int>();
+            hSync = fnv1a(hSync, state.data_ptr<float>(), sizeof(float) * state.numel());
+            hSync = fnv1a(hSync, std::get<1>(result).data_ptr<float>(), sizeof(float) * envs);
+            hSync = fnv1a(hSync, pDone, sizeof(int) * envs);
+            for ( int e=0; e<envs; ++e ) {
+                if ( pDone[e] ) {
+                    vec->env(e).reset();
+                }
+            }
+        }
+
+        //First-M-of-N: batches come in any order, each env hashes its own
+        //trajectory under a state-feedback policy
+        vec->seed(seed);
+        vec->set_batch_size(std::max(1, envs / 4));
+        vec->async_reset();
+        //Envs finish their first `steps` results at different times; the
+        //hash covers exactly those, whatever the envs did meanwhile
+        std::vector<uint64_t> vHash(envs, 1469598103934665603ull);
+        std::vector<int> vSeen(envs, 0);
+        for ( int complete=0; complete<envs; ) {
+            auto [state, reward, done, ids] = vec->recv();
+            const float *pState = state.data_ptr<float>();
+            const float *pReward = reward.data_ptr<float>();
+            const int *pDone = done.data_ptr<int>();
+            const int64_t *pIds = ids.data_ptr<int64_t>();
+            auto action = torch::zeros({ids.size(0), vec->action_dimension()});
+            float *pAct = action.data_ptr<float>();
+            for ( int k=0; k<ids.size(0); ++k ) {
+                if ( vSeen[pIds[k]] < steps ) {
+                    uint64_t &h = vHash[pIds[k]];
+                    h = fnv1a(h, pState + k * stateDim, sizeof(float) * stateDim);
+                    h = fnv1a(h, pReward + k, sizeof(float));
+                    h = fnv1a(h, pDone + k, sizeof(int));
+                    complete += steps == ++vSeen[pIds[k]];
+                }
+                if ( pDone[k] ) {
+                    vec->env(int(pIds[k])).reset();
+                }
+                for ( int a=0; a<vec->action_dimension(); ++a ) {
+                    pAct[k * vec->action_dimension() + a] = std::max(-1.0f, std::min(1.0f, 10.0f * pState[k * stateDim + 4 * a + 2]));
+                }
+            }
+            vec->send(action, ids);
+        }
+        for ( int left=envs; left>=vec->batch_size(); left-=vec->batch_size() ) {
+            vec->recv();
+        }
+        uint64_t hAsync = 1469598103934665603ull;
+        for ( int e=0; e<envs; ++e ) {
+            hAsync = fnv1a(hAsync, &vHash[e], sizeof(uint64_t));
+        }
+
+        if ( 1 == workers ) {
+            refSync = hSync;
+            refAsync = hAsync;
+        }
+        const bool ok = hSync == refSync && hAsync == refAsync;
+        same = same && ok;
+        printf("%-8d %016llx %016llx %s\n", workers, (unsigned long long)hSync,
+               (unsigned long long)hAsync, ok ? "ok" : "MISMATCH");
+    }
+    return same;
+}
+
+/** Cost of one CartPole_Continous::step() against the number of axes */
+static void bench_continous_axes()
+{
+    const int steps = 20000;
+    const int axes[] = {1, 2, 4, 8, 16, 32, 64};
+
+    printf("== CartPole_Continous step(), %d steps ==\n", steps);
+    printf("%6s %14s\n", "axes", "us/step");
+
+    for ( int k : axes ) {
+        CartPole_Continous gym(k);
+        gym.reset();
+        auto action = torch::zeros({k});
+
+        auto t0 = Clock::now();
+        for ( int s=0; s<steps; ++s ) {
+            gym.step(action);
+        }
+        printf("%6d %14.3f\n", k, 1e6 * seconds_since(t0) / steps);
+    }
+}
+
+/**
+ * Divergence of float trajectories from double ones. Both start from the same
+ * states and are balanced for 500 steps by the same PD controller (acting on
+ * their own state) plus the same action noise; reported are the max absolute
+ * state differences over the envs still running in both, and the number of
+ * envs whose episode length differs. Fails when a difference exceeds the
+ * 1e-6 that gym_torch.h documents for CartPole_Batch32.
+ */
+static bool bench_float_divergence(int envs)
+{
+    const int steps = 500;
+    const double bound = 1e-6;
+    const int n = gym_pad_lanes(envs);
+    CartPole_Physics physics;
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<double> init(-0.05, 0.05);
+    std::normal_distribution<double> noise(0.0, 0.1);
+    auto policy = [](double x, double x_dot, double theta, double theta_dot) {
+        return std::max(-1.0, std::min(1.0, 0.05*x + 0.1*x_dot + 2.0*theta + 0.5*theta_dot));
+    };
+
+    std::vector<double> xd(n), xdotd(n), thetad(n), thetadotd(n), forced(n, 0.0);
+    for ( int i=0; i<envs; ++i ) {
+        xd[i] = init(rng);
+        xdotd[i] = init(rng);
+        thetad[i] = init(rng);
+        thetadotd[i] = init(rng);
+    }
+    std::vector<float> xf(xd.begin(), xd.end()), xdotf(xdotd.begin(), xdotd.end());
+    std::vector<float> thetaf(thetad.begin(), thetad.end()), thetadotf(thetadotd.begin(), thetadotd.end());
+    std::vector<float> forcef(n, 0.0f);
+    std::vector<uint8_t> doned(n, 0), donef(n, 0);
+    std::vector<int> endd(envs, steps), endf(envs, steps);
+
+    CartPole_Lanes<double> lanesd{xd.data(), xdotd.data(), thetad.data(), thetadotd.data(),
+                                  forced.data(), doned.data(), n};
+    CartPole_Lanes<float> lanesf{xf.data(), xdotf.data(), thetaf.data(), thetadotf.data(),
+                                 forcef.data(), donef.data(), n};
+    auto kerneld = cartpole_kernel<double>(gym_best_isa(), physics.kinematics_integrator);
+    auto kernelf = cartpole_kernel<float>(gym_best_isa(), physics.kinematics_integrator);
+
+    printf("== float vs double, %d envs x %d steps ==\n", envs, steps);
+    printf("%6s %12s %12s %12s %12s %8s\n", "step", "|dx|", "|dx_dot|", "|dtheta|", "|dtheta_dot|", "running");
+
+    double worst = 0.0;
+    for ( int s=1; s<=steps; ++s ) {
+        for ( int i=0; i<envs; ++i ) {
+            const double e = noise(rng);
+            forced[i] = (policy(xd[i], xdotd[i], thetad[i], thetadotd[i]) + e) * physics.force_mag;
+            forcef[i] = float((policy(xf[i], xdotf[i], thetaf[i], thetadotf[i]) + e) * physics.force_mag);
+        }
+        kerneld(physics, lanesd);
+        kernelf(physics, lanesf);
+
+        double dx = 0.0, dxdot = 0.0, dtheta = 0.0, dthetadot = 0.0;
+        int running = 0;
+        for ( int i=0; i<envs; ++i ) {
+            if ( doned[i] && endd[i] == steps ) {
+                endd[i] = s;
+            }
+            if ( donef[i] && endf[i] == steps ) {
+                endf[i] = s;
+            }
+            if ( doned[i] || donef[i] ) {
+                continue;
+            }
+            ++running;
+            dx = std::max(dx, std::fabs(xd[i] - xf[i]));
+            dxdot = std::max(dxdot, std::fabs(xdotd[i] - xdotf[i]));
+            dtheta = std::max(dtheta, std::fabs(thetad[i] - thetaf[i]));
+            dthetadot = std::max(dthetadot, std::fabs(thetadotd[i] - thetadotf[i]));
+        }
+        worst = std::max({worst, dx, dxdot, dtheta, dthetadot});
+        if ( s == 1 || s % 100 == 0 ) {
+            printf("%6d %12.3e %12.3e %12.3e %12.3e %8d\n", s, dx, dxdot, dtheta, dthetadot, running);
+        }
+    }
+
+    int mismatched = 0;
+    for ( int i=0; i<envs; ++i ) {
+        mismatched += endd[i] != endf[i];
+    }
+    printf("episode length differs in %d of %d envs\n", mismatched, envs);
+    const bool exceeds = worst > bound;
+    printf("max difference %.3e, bound %.0e%s\n", worst, bound, exceeds ? "  EXCEEDS" : "");
+    return !exceeds;
+}
+
+/**
+ * Max absolute error of the sin/cos kernels against libm, and throughput.
+ * Fails when an error exceeds the bound gym_simd.h documents for the mode:
+ * Libm 0, Fast 1e-7 and Precise 1e-12 for double over |x| <= 1e5, and float
+ * rounding (1e-7) for float over the pole angle range.
+ */
+template<typename T>
+static bool bench_sincos(double range)
+{
+    const int n = gym_pad_lanes(1 << 16);
+    const int repeat = 100;
+    const Gym_ISA isas[] = {Gym_ISA::Scalar, Gym_ISA::AVX2, Gym_ISA::AVX512};
+    const Sincos_Mode modes[] = {Sincos_Mode::Libm, Sincos_Mode::Fast, Sincos_Mode::Precise};
+    auto bound = [](Sincos_Mode mode) {
+        if ( sizeof(T) == sizeof(float) ) {
+            return 1e-7;
+        }
+        return Sincos_Mode::Libm == mode ? 0.0 : (Sincos_Mode::Fast == mode ? 1e-7 : 1e-12);
+    };
+
+    std::vector<T> x(n), s(n), c(n);
+    for ( int i=0; i<n; ++i ) {
+        x[i] = T(range * (2.0 * i / (n - 1) - 1.0));
+    }
+
+    printf("== sin/cos<%s> over +-%g rad ==\n", sizeof(T) == sizeof(float) ? "float" : "double", range);
+    printf("%-8s %-8s %12s %12s %14s\n", "isa", "sincos", "max error", "bound", "values/s");
+
+    bool ok = true;
+    for ( auto isa : isas ) {
+        if ( !gym_isa_supported(isa) ) {
+            continue;
+        }
+        for ( auto mode : modes ) {
+            auto kernel = sincos_kernel<T>(isa, mode);
+            kernel(x.data(), s.data(), c.data(), n);
+
+            double err = 0.0;
+            for ( int i=0; i<n; ++i ) {
+                const double xi = double(x[i]);
+                err = std::max(err, std::fabs(double(s[i]) - std::sin(xi)));
+                err = std::max(err, std::fabs(double(c[i]) - std::cos(xi)));
+            }
+
+            auto t0 = Clock::now();
+            for ( int r=0; r<repeat; ++r ) {
+                kernel(x.data(), s.data(), c.data(), n);
+            }
+            const double rate = double(n) * repeat / seconds_since(t0);
+
+            const bool exceeds = err > bound(mode);
+            printf("%-8s %-8s %12.3e %12.0e %14.3e%s\n", gym_isa_name(isa), gym_sincos_name(mode),
+                   err, bound(mode), rate, exceeds ? "  EXCEEDS" : "");
+            ok &= !exceeds;
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    const int envs = 1 < argc ? std::atoi(argv[1]) : 4096;
+
+    bool ok = true;
+#if defined(__linux__)
+    //First: the env processes are forked, before any pool starts threads
+    ok &= bench_subproc_failure();
+    bench_subproc(std::min(envs, 256));
+#endif
+
+    bench_cartpole_isa<double>(envs);
+    bench_cartpole_isa<float>(envs);
+    ok &= bench_float_divergence(envs);
+    bench_continous_axes();
+    ok &= bench_step_into(envs);
+    bench_vector_env(std::min(envs, 256));
+    bench_vector_async(std::min(envs, 256));
+    bench_work_stealing(std::min(envs, 256));
+    bench_frame_stack();
+    bench_pinning(std::min(envs, 256));
+    bench_transition_queue();
+    bench_first_m_of_n(std::min(envs, 32));
+    bench_thread_budget(std::min(envs, 1024));
+    ok &= bench_determinism(std::min(envs, 64));
+    CartPole_Physics physics;
+    ok &= bench_sincos<double>(physics.theta_threshold_radians);
+    ok &= bench_sincos<double>(1e5);
+    ok &= bench_sincos<float>(physics.theta_threshold_radians);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -28,6 +28,7 @@
 #include <math.h>
 #include <assert.h>
 #include <stddef.h>
+#include <string.h>
 #include <algorithm>
 #include <chrono>
 #include <thread>
@@ -35,6 +36,10 @@
 #include <glad/gl.h>
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
+#if defined(GYM_GL_EGL)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 
 #include "gym_gl.h"
 #include "gym_torch.h"
@@ -69,11 +74,11 @@ static const char* fragment_shader_text =
 "#version 330\n"
 "uniform vec4 v4_color;\n"
 "in float depth;\n"
-"out vec4 color;\n"
+"out vec2 color;\n"
 "\n"
 "void main()\n"
 "{\n"
-"    color = vec4(v4_color.rgb, depth); \n"
+"    color = vec2(v4_color.b, depth); \n"	//(ambient, depth) into the RG8 target
 "}\n";
 
 /**********************************************************************
@@ -154,7 +159,18 @@ static GLuint pole_ibo;
 static GLuint pole;
 static GLuint pole_vbo;
 
+/* Offscreen RG8 target: only the two channels the env keeps are rendered
+ * and read back
+ */
+static GLuint target_fbo;
+static GLuint target_color;
+static GLuint target_depth;
+
 static GLFWwindow* window;
+#if defined(GYM_GL_EGL)
+static EGLDisplay egl_display = EGL_NO_DISPLAY;
+static EGLContext egl_context = EGL_NO_CONTEXT;
+#endif
 static int iter;
 static double dt;
 static double last_update_time;
@@ -307,26 +323,31 @@ static void error_callback(int error, const char* description)
 }
 
 
-Gym_Renderer_CartPoleContinuous::Gym_Renderer_CartPoleContinuous(const int res_x, const int res_y)
-	:m_iWidth(res_x),
-	 m_iHeight(res_y)
+/**********************************************************************
+ * Context creation
+ *********************************************************************/
+
+/* GL 3.3 core context of a GLFW window, shown or not
+ */
+static bool create_window_context(int width, int height, bool visible)
 {
     glfwSetErrorCallback(error_callback);
 
     if (!glfwInit())
-        exit(EXIT_FAILURE);
+        return false;
 
     glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GLFW_TRUE);
 	
-	window = glfwCreateWindow(m_iWidth, m_iHeight, "Gym_CPP", NULL, NULL);
+	window = glfwCreateWindow(width, height, "Gym_CPP", NULL, NULL);
     if (! window )
     {
         glfwTerminate();
-        exit(EXIT_FAILURE);
+        return false;
     }
 
     /* Register events callback */
@@ -334,13 +355,109 @@ Gym_Renderer_CartPoleContinuous::Gym_Renderer_CartPoleContinuous(const int res_x
 
     glfwMakeContextCurrent(window);
     gladLoadGL(glfwGetProcAddress);
+    return true;
+}
+
+#if defined(GYM_GL_EGL)
+static GLADapiproc egl_proc_address(const char* name)
+{
+    return (GLADapiproc)eglGetProcAddress(name);
+}
+
+/* GL 3.3 core context without any surface, rendering goes to target_fbo
+ */
+static bool create_egl_context()
+{
+#if defined(EGL_PLATFORM_SURFACELESS_MESA)
+    egl_display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+#endif
+    if (egl_display == EGL_NO_DISPLAY)
+        egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, NULL, NULL))
+    {
+        fprintf(stderr, "ERROR: No EGL display\n");
+        egl_display = EGL_NO_DISPLAY;
+        return false;
+    }
+
+    const EGLint config_attribs[] = {
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configs = 0;
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    if (!eglChooseConfig(egl_display, config_attribs, &config, 1, &configs) || configs < 1
+        || !eglBindAPI(EGL_OPENGL_API)
+        || (egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, context_attribs)) == EGL_NO_CONTEXT
+        || !eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context))
+    {
+        fprintf(stderr, "ERROR: No surfaceless EGL OpenGL 3.3 context (0x%x)\n", eglGetError());
+        if (egl_context != EGL_NO_CONTEXT)
+            eglDestroyContext(egl_display, egl_context);
+        eglTerminate(egl_display);
+        egl_context = EGL_NO_CONTEXT;
+        egl_display = EGL_NO_DISPLAY;
+        return false;
+    }
+    gladLoadGL(egl_proc_address);
+    return true;
+}
+#endif
+
+static void release_context()
+{
+#if defined(GYM_GL_EGL)
+    if (egl_display != EGL_NO_DISPLAY)
+    {
+        eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(egl_display, egl_context);
+        eglTerminate(egl_display);
+        egl_context = EGL_NO_CONTEXT;
+        egl_display = EGL_NO_DISPLAY;
+        return;
+    }
+#endif
+    if (window)
+        glfwDestroyWindow(window);
+    window = NULL;
+    glfwTerminate();
+}
+
+
+Gym_Renderer_CartPoleContinuous::Gym_Renderer_CartPoleContinuous(const int res_x, const int res_y,
+																 Gym_GL_Backend backend)
+	:m_iWidth(res_x),
+	 m_iHeight(res_y),
+	 m_backend(backend)
+{
+	if ( m_backend == Gym_GL_Backend::Headless ) {
+#if defined(GYM_GL_EGL)
+		if ( !create_egl_context() ) {
+			exit(EXIT_FAILURE);
+		}
+#else
+		fprintf(stderr, "Headless rendering needs a build with GYM_GL_EGL. "
+						"A hidden window will be used.\n");
+		m_backend = Gym_GL_Backend::Hidden;
+#endif
+	}
+	if ( m_backend != Gym_GL_Backend::Headless
+		 && !create_window_context(m_iWidth, m_iHeight, m_backend == Gym_GL_Backend::Window) ) {
+		exit(EXIT_FAILURE);
+	}
 
     /* Prepare opengl resources for rendering */
     shader_program = make_shader_program(vertex_shader_text, fragment_shader_text);
 
     if (shader_program == 0u)
     {
-        glfwTerminate();
+        release_context();
         exit(EXIT_FAILURE);
     }
 	
@@ -396,12 +513,56 @@ Gym_Renderer_CartPoleContinuous::Gym_Renderer_CartPoleContinuous(const int res_x
 	glUniformMatrix4fv(uloc_model, 1, GL_FALSE, model_matrix);
 	
 	glUniform4f(uloc_color, 0.4f, 0.5f, 1.0f, 1.0f);
+
+	glGenRenderbuffers(1, &target_color);
+	glBindRenderbuffer(GL_RENDERBUFFER, target_color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RG8, m_iWidth, m_iHeight);
+	glGenRenderbuffers(1, &target_depth);
+	glBindRenderbuffer(GL_RENDERBUFFER, target_depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, m_iWidth, m_iHeight);
+
+	glGenFramebuffers(1, &target_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, target_fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target_color);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target_depth);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		fprintf(stderr, "ERROR: RG8 render target is incomplete\n");
+		release_context();
+		exit(EXIT_FAILURE);
+	}
+	/* Rows of RG pairs are not 4-byte aligned for odd widths */
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
 }
 
 Gym_Renderer_CartPoleContinuous::~Gym_Renderer_CartPoleContinuous()
 {
-    glfwDestroyWindow(window);
-	glfwTerminate();
+	glDeleteFramebuffers(1, &target_fbo);
+	glDeleteRenderbuffers(1, &target_depth);
+	glDeleteRenderbuffers(1, &target_color);
+	glDeleteProgram(shader_program);
+	release_context();
+}
+
+bool Gym_Renderer_CartPoleContinuous::available(Gym_GL_Backend backend)
+{
+	bool created = false;
+	if ( backend == Gym_GL_Backend::Headless ) {
+#if defined(GYM_GL_EGL)
+		created = create_egl_context();
+#endif
+	} else {
+		created = create_window_context(1, 1, false);
+	}
+	if ( created ) {
+		release_context();
+	}
+	return created;
+}
+
+Gym_GL_Backend Gym_Renderer_CartPoleContinuous::backend() const
+{
+	return m_backend;
 }
 
 std::pair<int,int> Gym_Renderer_CartPoleContinuous::render_state(std::vector<double> pos,
@@ -411,7 +572,20 @@ std::pair<int,int> Gym_Renderer_CartPoleContinuous::render_state(std::vector<dou
 	if ( pos.size() < 1 || ang.size() < 1 ) {
 		return std::pair<int,int>{0, 0};
 	}
+	data.resize(m_iWidth * m_iHeight);
+	render_state({pos.data(), pos.size()}, {ang.data(), ang.size()},
+				 {reinterpret_cast<uint32_t*>(data.data()), data.size()});
+	return {m_iWidth, m_iHeight};
+}
 
+bool Gym_Renderer_CartPoleContinuous::draw(Gym_Span<const double> pos,
+										   Gym_Span<const double> ang)
+{
+	if ( pos.size < 1 || ang.size < 1 ) {
+		return false;
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, target_fbo);
 	glViewport(0, 0, m_iWidth, m_iHeight);
     glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -428,7 +602,7 @@ std::pair<int,int> Gym_Renderer_CartPoleContinuous::render_state(std::vector<dou
 	float gamma = 0.0f;	//Rot-Z
 	
 	gamma = -ang[0];
-	if ( 1 < ang.size()) {
+	if ( 1 < ang.size) {
 		alpha = -ang[1];
 	}
 	float cosA = cos(alpha), sinA = sin(alpha);
@@ -452,42 +626,134 @@ std::pair<int,int> Gym_Renderer_CartPoleContinuous::render_state(std::vector<dou
 	glDrawElements(GL_TRIANGLES, 3*12, GL_UNSIGNED_INT, 0);
 	 
 	//glUseProgram(0);
-	//glDisable(GL_DEPTH_TEST);
-	data.resize(m_iWidth * m_iHeight);
-    glReadPixels(0, 0, m_iWidth, m_iHeight, GL_RGBA, GL_UNSIGNED_BYTE, data.data());
-	
 	glDisable(GL_CULL_FACE);
 	glDisable(GL_BLEND);
     glDisable(GL_DEPTH_TEST);
-	
+	return true;
+}
+
+void Gym_Renderer_CartPoleContinuous::present()
+{
+	if ( m_backend != Gym_GL_Backend::Window ) {
+		return;
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, target_fbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBlitFramebuffer(0, 0, m_iWidth, m_iHeight, 0, 0, m_iWidth, m_iHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, target_fbo);
+
 	glfwSwapBuffers(window);
 	glfwPollEvents();
-	
-	return {m_iWidth, m_iHeight};
 }
 
+void Gym_Renderer_CartPoleContinuous::render_state(Gym_Span<const double> pos,
+												   Gym_Span<const double> ang,
+												   Gym_Span<uint8_t> rg)
+{
+	if ( rg.size < size_t(m_iWidth) * m_iHeight * 2 || !draw(pos, ang) ) {
+		return;
+	}
+	glReadPixels(0, 0, m_iWidth, m_iHeight, GL_RG, GL_UNSIGNED_BYTE, rg.data);
+	present();
+}
+
+void Gym_Renderer_CartPoleContinuous::render_state(Gym_Span<const double> pos,
+												   Gym_Span<const double> ang,
+												   Gym_Span<uint32_t> rgba)
+{
+	const size_t pixels = size_t(m_iWidth) * m_iHeight;
+	if ( rgba.size < pixels ) {
+		return;
+	}
+	m_vRG.resize(pixels * 2);
+	render_state(pos, ang, {m_vRG.data(), m_vRG.size()});
+
+	/* Same bytes as the RGBA target had in B and A, R and G are not rendered */
+	uint8_t *bytes = reinterpret_cast<uint8_t*>(rgba.data);
+	for ( size_t i=0; i<pixels; ++i ) {
+		bytes[4*i] = bytes[4*i + 1] = 0;
+		bytes[4*i + 2] = m_vRG[2*i];
+		bytes[4*i + 3] = m_vRG[2*i + 1];
+	}
+}
+
+
+
+/**
+Frames per second of the vision env (render, RG readback and step) with
+each backend. The window is paced by the compositor when the driver syncs
+swaps to the display, the hidden window and the headless context are not.
+Backends that cannot be created here (no display, no GYM_GL_EGL) are skipped.
+*/
+static void bench_backends(int frames)
+{
+	const struct { Gym_GL_Backend backend; const char* name; } backends[] = {
+		{Gym_GL_Backend::Window, "window"},
+		{Gym_GL_Backend::Hidden, "hidden"},
+		{Gym_GL_Backend::Headless, "headless"},
+	};
+	printf("%-10s %12s\n", "backend", "frames/s");
+	for (const auto& b : backends)
+	{
+		if (!Gym_Renderer_CartPoleContinuous::available(b.backend))
+		{
+			printf("%-10s %12s\n", b.name, "skipped");
+			continue;
+		}
+		Gym_Renderer_CartPoleContinuous renderer(128, 128, b.backend);
+		gen_buffer_objects(shader_program);
+
+		Gym_Render_Callback_RG cb =
+		[&renderer](Gym_Span<const double> pos, Gym_Span<const double> ang, Gym_Span<uint8_t> rg)
+		{
+			renderer.render_state(pos, ang, rg);
+		};
+		CartPole_ContinousVision gym;
+		gym.setRenderer(&cb, 128, 128);
+		gym.seed(1);
+		gym.reset();
+
+		const auto t0 = std::chrono::steady_clock::now();
+		for (int i = 0; i < frames; ++i)
+		{
+			auto &&rc = gym.step(gym.sample_action());
+			if (std::get<2>(rc).item().toInt())
+				gym.reset();
+		}
+		const std::chrono::duration<double> sec = std::chrono::steady_clock::now() - t0;
+		printf("%-10s %12.1f\n", renderer.backend() == b.backend ? b.name : "hidden",
+			   frames / sec.count());
+	}
+}
 
 /**
 The following is an example how to setup the renderer for Vision-based Gym.
+Usage: gym [--headless | --bench [frames]]
 */
 int main(int argc, char** argv)
 {
-	Gym_Renderer_CartPoleContinuous renderer(128, 128);
+	if (1 < argc && strcmp(argv[1], "--bench") == 0)
+	{
+		bench_backends(2 < argc ? atoi(argv[2]) : 2000);
+		exit(EXIT_SUCCESS);
+	}
+	const bool headless = 1 < argc && strcmp(argv[1], "--headless") == 0;
+
+	Gym_Renderer_CartPoleContinuous renderer(128, 128, headless ? Gym_GL_Backend::Headless
+																: Gym_GL_Backend::Window);
     gen_buffer_objects(shader_program);
 	
 	CartPole_ContinousVision gym;
 	
-	std::function<std::pair<int,int> (std::vector<double>,
-                                                std::vector<double>,
-                                                std::vector<unsigned int>&)> cb = 
-	[&renderer](std::vector<double> pos, std::vector<double> ang, std::vector<unsigned int>& data)
+	Gym_Render_Callback_RG cb =
+	[&renderer](Gym_Span<const double> pos, Gym_Span<const double> ang, Gym_Span<uint8_t> rg)
 	{
-		return renderer.render_state(pos, ang, data);
+		renderer.render_state(pos, ang, rg);
 	};
 	
-	gym.setRender_Callback(&cb);
+	gym.setRenderer(&cb, 128, 128);
 	
-    while (!glfwWindowShouldClose(window))
+    while (!window || !glfwWindowShouldClose(window))
     {
 		auto state = gym.reset();
 		auto frame = 0;
@@ -505,7 +771,8 @@ int main(int argc, char** argv)
 			}
 			/* display and process events through callbacks */
 
-			std::this_thread::sleep_for(32ms);
+			if (!headless)
+				std::this_thread::sleep_for(32ms);
 		}
 		//update_view_camera();
     }
@@ -1,15 +1,54 @@
 #include <vector>
 
+#include "gym_render.h"
+
+/**
+ * Where the GL context lives. Window shows every frame (swap and poll,
+ * paced by the compositor); Hidden is an invisible GLFW window, which still
+ * needs a display server; Headless is an EGL context without any surface
+ * (Mesa surfaceless/llvmpipe or a GPU driver), built with GYM_GL_EGL and
+ * falling back to Hidden otherwise. Hidden and Headless never swap or poll.
+ */
+enum class Gym_GL_Backend
+{
+	Window,
+	Hidden,
+	Headless
+};
+
 class Gym_Renderer_CartPoleContinuous
 {
 public:
-	explicit Gym_Renderer_CartPoleContinuous(const int res_x = 128, const int res_y = 128);
+	explicit Gym_Renderer_CartPoleContinuous(const int res_x = 128, const int res_y = 128,
+											 Gym_GL_Backend backend = Gym_GL_Backend::Window);
 	~Gym_Renderer_CartPoleContinuous();
+
+	//Whether a context of this backend can be created here (the constructor
+	//exits when it cannot). Probes by creating one, so not while a renderer lives
+	static bool available(Gym_GL_Backend backend);
+	//The backend in use, Hidden when Headless fell back to it
+	Gym_GL_Backend backend() const;
 	
 	std::pair<int,int> render_state(std::vector<double> pos,
 									 std::vector<double> ang,
 									 std::vector<unsigned int>& data);
+	//Reads the frame back straight into rgba (width * height words),
+	//ambient and depth in bytes 2 and 3
+	void render_state(Gym_Span<const double> pos,
+					  Gym_Span<const double> ang,
+					  Gym_Span<uint32_t> rgba);
+	//Reads back only the (ambient, depth) pairs of the RG8 target
+	void render_state(Gym_Span<const double> pos,
+					  Gym_Span<const double> ang,
+					  Gym_Span<uint8_t> rg);
 private:
+	//Draws the pose into the offscreen target, false without a pose
+	bool draw(Gym_Span<const double> pos, Gym_Span<const double> ang);
+	//Shows the target in the window, nothing without one
+	void present();
+
 	int m_iWidth;
 	int m_iHeight;
+	Gym_GL_Backend m_backend;
+	std::vector<uint8_t> m_vRG;		//RG pairs for the RGBA readback
 };
\ No newline at end of file
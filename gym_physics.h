@@ -0,0 +1,231 @@
+#ifndef GYM_PHYSICS_H
+#define GYM_PHYSICS_H
+
+#include <cmath>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+//Lane helpers are always inlined into the kernels so that they inherit the
+//instruction set of each gym_simd*.cpp translation unit
+#if defined(_MSC_VER)
+#define GYM_LANE_INLINE __forceinline
+#else
+#define GYM_LANE_INLINE inline __attribute__((always_inline))
+#endif
+
+/**
+ * Kinematics integrators, chosen once at construction. Each one maps to a
+ * policy type below so the stepping code is specialised at compile time.
+ */
+enum class Kinematics_Integrator
+{
+    Euler,
+    Semi_Implicit_Euler,
+    RK4
+};
+
+inline void gym_sincos(double a, double &s, double &c)
+{
+    s = std::sin(a);
+    c = std::cos(a);
+}
+
+/** sin/cos through gym_sincos(), i.e. libm (per lane for the SIMD types) */
+struct Sincos_Libm
+{
+    template<class V>
+    GYM_LANE_INLINE static void apply(const V &a, V &s, V &c)
+    {
+        gym_sincos(a, s, c);
+    }
+};
+
+/**
+ * Accelerations of one cart-pole axis. V is double or one of the SIMD lane
+ * types of gym_simd*.cpp (which provide their own gym_sincos()), S computes
+ * sin/cos (see Sincos_Libm and the polynomials in gym_simd_kernel.h).
+ * For the interested reader:
+ * https://coneural.org/florian/papers/05_cart_pole.pdf
+ */
+template<class V, class S = Sincos_Libm>
+struct CartPole_Accel
+{
+    V force;
+    V gravity;
+    V masspole;
+    V total_mass;
+    V length;
+    V polemass_length;
+    V four_thirds;
+
+    GYM_LANE_INLINE void operator()(const V &theta, const V &theta_dot, V &xacc, V &thetaAcc) const
+    {
+        V sintheta, costheta;
+        S::apply(theta, sintheta, costheta);
+
+        const V temp = (force + polemass_length * theta_dot * theta_dot * sintheta ) / total_mass;
+        thetaAcc = (gravity * sintheta - costheta * temp) /
+                (length * (four_thirds - masspole * costheta * costheta / total_mass));
+        xacc = temp - polemass_length * thetaAcc * costheta / total_mass;
+    }
+};
+
+/** Step sizes derived from tau, precomputed once per kernel call */
+template<class V>
+struct Integrator_Step
+{
+    V tau;
+    V half_tau;
+    V sixth_tau;
+};
+
+struct Integrator_Euler
+{
+    template<class V, class Accel>
+    GYM_LANE_INLINE static void advance(V &x, V &x_dot, V &theta, V &theta_dot,
+                                        const Integrator_Step<V> &h, const Accel &accel)
+    {
+        V xacc, thetaAcc;
+        accel(theta, theta_dot, xacc, thetaAcc);
+
+        x = x + h.tau * x_dot;
+        x_dot = x_dot + h.tau * xacc;
+        theta = theta + h.tau * theta_dot;
+        theta_dot = theta_dot + h.tau * thetaAcc;
+    }
+};
+
+struct Integrator_Semi_Implicit_Euler
+{
+    template<class V, class Accel>
+    GYM_LANE_INLINE static void advance(V &x, V &x_dot, V &theta, V &theta_dot,
+                                        const Integrator_Step<V> &h, const Accel &accel)
+    {
+        V xacc, thetaAcc;
+        accel(theta, theta_dot, xacc, thetaAcc);
+
+        x_dot = x_dot + h.tau * xacc;
+        x = x + h.tau * x_dot;
+        theta_dot = theta_dot + h.tau * thetaAcc;
+        theta = theta + h.tau * theta_dot;
+    }
+};
+
+/** Classic 4th order Runge-Kutta, accurate enough for a larger tau */
+struct Integrator_RK4
+{
+    template<class V, class Accel>
+    GYM_LANE_INLINE static void advance(V &x, V &x_dot, V &theta, V &theta_dot,
+                                        const Integrator_Step<V> &h, const Accel &accel)
+    {
+        //The accelerations do not depend on x, so x only integrates x_dot
+        V a1, b1, a2, b2, a3, b3, a4, b4;
+        accel(theta, theta_dot, a1, b1);
+
+        const V xd2 = x_dot + h.half_tau * a1;
+        const V td2 = theta_dot + h.half_tau * b1;
+        accel(theta + h.half_tau * theta_dot, td2, a2, b2);
+
+        const V xd3 = x_dot + h.half_tau * a2;
+        const V td3 = theta_dot + h.half_tau * b2;
+        accel(theta + h.half_tau * td2, td3, a3, b3);
+
+        const V xd4 = x_dot + h.tau * a3;
+        const V td4 = theta_dot + h.tau * b3;
+        accel(theta + h.tau * td3, td4, a4, b4);
+
+        x = x + h.sixth_tau * (x_dot + (xd2 + xd2) + (xd3 + xd3) + xd4);
+        theta = theta + h.sixth_tau * (theta_dot + (td2 + td2) + (td3 + td3) + td4);
+        x_dot = x_dot + h.sixth_tau * (a1 + (a2 + a2) + (a3 + a3) + a4);
+        theta_dot = theta_dot + h.sixth_tau * (b1 + (b2 + b2) + (b3 + b3) + b4);
+    }
+};
+
+/**
+ * Torch-free cart-pole dynamics shared by the CartPole environments.
+ * The state of one axis is the plain array [x, x_dot, theta, theta_dot].
+ */
+struct CartPole_Physics
+{
+    explicit CartPole_Physics(Kinematics_Integrator integrator = Kinematics_Integrator::Euler)
+        :kinematics_integrator(integrator)
+    {
+    }
+
+    const double gravity = 9.8;
+    const double masscart = 1.0;
+    const double masspole = 0.1;
+    const double total_mass = masspole + masscart;
+    const double length = 1.0;    // actually half the pole's length
+    const double polemass_length = masspole * length;
+    const double force_mag = 3*10.0;
+    const double tau = 1.0/30.0;  //seconds between state updates 60Hz
+
+    const double theta_threshold_radians = 45.0 * M_PI / 180.0;
+    const double x_threshold = 4 * 2.4;
+
+    const Kinematics_Integrator kinematics_integrator;
+
+    //Physics substeps per action, each advancing tau / substeps
+    int substeps = 1;
+
+    double substep_tau() const
+    {
+        return tau / substeps;
+    }
+
+    CartPole_Accel<double> accel(double force) const
+    {
+        return {force, gravity, masspole, total_mass, length, polemass_length, 4.0 / 3.0};
+    }
+
+    Integrator_Step<double> integrator_step() const
+    {
+        const double h = substep_tau();
+        return {h, 0.5 * h, h / 6.0};
+    }
+
+    /** Advance one axis by substep_tau() under the given force with integrator I */
+    template<class I>
+    void step_axis(double &x, double &x_dot, double &theta, double &theta_dot,
+                   double force) const
+    {
+        I::advance(x, x_dot, theta, theta_dot, integrator_step(), accel(force));
+    }
+
+    /** Same as above with the integrator chosen at construction */
+    void step_axis(double &x, double &x_dot, double &theta, double &theta_dot,
+                   double force) const
+    {
+        switch ( kinematics_integrator ) {
+        case Kinematics_Integrator::Euler:
+            step_axis<Integrator_Euler>(x, x_dot, theta, theta_dot, force);
+            break;
+        case Kinematics_Integrator::Semi_Implicit_Euler:
+            step_axis<Integrator_Semi_Implicit_Euler>(x, x_dot, theta, theta_dot, force);
+            break;
+        case Kinematics_Integrator::RK4:
+            step_axis<Integrator_RK4>(x, x_dot, theta, theta_dot, force);
+            break;
+        }
+    }
+
+    /** Same as above for one axis stored as 4 contiguous doubles */
+    void step_axis(double *s, double force) const
+    {
+        step_axis(s[0], s[1], s[2], s[3], force);
+    }
+
+    /** Termination test of the continuous variants (cart, angle and pole tip) */
+    bool continous_done(double x, double theta) const
+    {
+        const double x_tip = 2*length * std::sin(theta) + x;
+        return (x < -x_threshold) || (x > x_threshold) ||
+            (theta < -theta_threshold_radians) || (theta > theta_threshold_radians)
+                || (x_tip < -x_threshold) || (x_tip > x_threshold);
+    }
+};
+
+#endif // GYM_PHYSICS_H
@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "gym_queue.h"
+
+namespace {
+
+//Contiguous data of t as type, converted when it is not already
+const void* typed_data(const torch::Tensor &t, torch::ScalarType type, torch::Tensor &keep)
+{
+    if ( t.scalar_type() == type && t.is_contiguous() ) {
+        return t.data_ptr();
+    }
+    keep = t.to(type).contiguous();
+    return keep.data_ptr();
+}
+
+const float* float_data(const torch::Tensor &t, torch::Tensor &keep)
+{
+    return static_cast<const float*>(typed_data(t, torch::kFloat, keep));
+}
+
+size_t state_bytes(torch::ScalarType type)
+{
+    if ( torch::kFloat == type ) {
+        return sizeof(float);
+    }
+    if ( torch::kUInt8 == type ) {
+        return sizeof(uint8_t);
+    }
+    throw std::invalid_argument("Gym_TransitionQueue states are kFloat or kUInt8");
+}
+
+//Rows [first, first + n) of a ring of `rows` rows into dst, in order
+template<typename T>
+void copy_rows(T *dst, const std::vector<T> &ring, size_t rows, size_t width, size_t first, size_t n)
+{
+    const size_t head = std::min(n, rows - first);
+    std::memcpy(dst, ring.data() + first * width, head * width * sizeof(T));
+    std::memcpy(dst + head * width, ring.data(), (n - head) * width * sizeof(T));
+}
+
+}
+
+Gym_TransitionQueue::Gym_TransitionQueue(size_t capacity, int stateDim, int actionDim,
+                                         Gym_Producers producers, torch::ScalarType stateType)
+    :mRing(capacity, producers)
+    ,mStateDim(stateDim)
+    ,mActionDim(actionDim)
+    ,mStateType(stateType)
+    ,mStateBytes(state_bytes(stateType) * stateDim)
+    ,mvState(mRing.capacity() * mStateBytes)
+    ,mvAction(mRing.capacity() * actionDim)
+    ,mvReward(mRing.capacity())
+    ,mvNextState(mRing.capacity() * mStateBytes)
+    ,mvDone(mRing.capacity())
+{
+
+}
+
+bool Gym_TransitionQueue::try_push(const float *state, const float *action, float reward,
+                                   const float *nextState, int done)
+{
+    if ( torch::kFloat != mStateType ) {
+        throw std::invalid_argument("Gym_TransitionQueue: float states pushed into a kUInt8 queue");
+    }
+    return push_bytes(state, action, reward, nextState, done);
+}
+
+bool Gym_TransitionQueue::try_push(const uint8_t *state, const float *action, float reward,
+                                   const uint8_t *nextState, int done)
+{
+    if ( torch::kUInt8 != mStateType ) {
+        throw std::invalid_argument("Gym_TransitionQueue: uint8 states pushed into a kFloat queue");
+    }
+    return push_bytes(state, action, reward, nextState, done);
+}
+
+bool Gym_TransitionQueue::push_bytes(const void *state, const float *action, float reward,
+                                     const void *nextState, int done)
+{
+    uint64_t pos;
+    if ( !mRing.try_claim(pos) ) {
+        return false;
+    }
+    const size_t i = mRing.index(pos);
+    std::memcpy(mvState.data() + i * mStateBytes, state, mStateBytes);
+    std::memcpy(mvAction.data() + i * mActionDim, action, sizeof(float) * mActionDim);
+    mvReward[i] = reward;
+    std::memcpy(mvNextState.data() + i * mStateBytes, nextState, mStateBytes);
+    mvDone[i] = done;
+    mRing.publish(pos);
+    return true;
+}
+
+bool Gym_TransitionQueue::try_push(const torch::Tensor &state, const torch::Tensor &action, float reward,
+                                   const torch::Tensor &nextState, int done)
+{
+    TORCH_CHECK(state.numel() == mStateDim && nextState.numel() == mStateDim,
+                "Gym_TransitionQueue: states of ", state.numel(), " and ", nextState.numel(),
+                " elements pushed into a queue of state dimension ", mStateDim);
+    TORCH_CHECK(action.numel() == mActionDim,
+                "Gym_TransitionQueue: action of ", action.numel(),
+                " elements pushed into a queue of action dimension ", mActionDim);
+    //Floating states convert into a kFloat queue, a kUInt8 queue only takes bytes
+    TORCH_CHECK(state.scalar_type() == nextState.scalar_type() &&
+                (state.scalar_type() == mStateType ||
+                 (torch::kFloat == mStateType && state.is_floating_point())),
+                "Gym_TransitionQueue: ", state.scalar_type(), "/", nextState.scalar_type(),
+                " states pushed into a ", mStateType, " queue");
+    TORCH_CHECK(action.is_floating_point(),
+                "Gym_TransitionQueue: ", action.scalar_type(), " action, expected a floating type");
+    torch::Tensor keepState, keepAction, keepNext;
+    return push_bytes(typed_data(state, mStateType, keepState), float_data(action, keepAction), reward,
+                      typed_data(nextState, mStateType, keepNext), done);
+}
+
+Gym_TransitionBatch Gym_TransitionQueue::make_batch(int rows) const
+{
+    Gym_TransitionBatch batch;
+    const auto stateOptions = torch::TensorOptions().dtype(mStateType);
+    batch.state = torch::zeros({rows, mStateDim}, stateOptions);
+    batch.action = torch::zeros({rows, mActionDim});
+    batch.reward = torch::zeros({rows});
+    batch.next_state = torch::zeros({rows, mStateDim}, stateOptions);
+    batch.done = torch::zeros({rows}, torch::TensorOptions().dtype(torch::kInt));
+    batch.size = 0;
+    return batch;
+}
+
+int Gym_TransitionQueue::pop_batch(Gym_TransitionBatch &batch)
+{
+    uint64_t first;
+    const size_t n = mRing.try_acquire(size_t(batch.reward.size(0)), first);
+    const size_t rows = mRing.capacity();
+    const size_t i = mRing.index(first);
+
+    copy_rows(static_cast<uint8_t*>(batch.state.data_ptr()), mvState, rows, mStateBytes, i, n);
+    copy_rows(batch.action.data_ptr<float>(), mvAction, rows, mActionDim, i, n);
+    copy_rows(batch.reward.data_ptr<float>(), mvReward, rows, 1, i, n);
+    copy_rows(static_cast<uint8_t*>(batch.next_state.data_ptr()), mvNextState, rows, mStateBytes, i, n);
+    copy_rows(batch.done.data_ptr<int>(), mvDone, rows, 1, i, n);
+
+    mRing.release(n);
+    batch.size = int(n);
+    return batch.size;
+}
+
+size_t Gym_TransitionQueue::capacity() const
+{
+    return mRing.capacity();
+}
+
+int Gym_TransitionQueue::state_dimension() const
+{
+    return mStateDim;
+}
+
+int Gym_TransitionQueue::action_dimension() const
+{
+    return mActionDim;
+}
+
+torch::ScalarType Gym_TransitionQueue::state_type() const
+{
+    return mStateType;
+}
@@ -0,0 +1,232 @@
+#ifndef GYM_QUEUE_H
+#define GYM_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <torch/torch.h>
+
+/**
+ * Bounded lock-free queues between actor threads and the learner thread.
+ * Gym_SlotRing only hands out slot positions (Vyukov's bounded queue: one
+ * sequence number per slot says whether it is free or filled), the payload
+ * lives in the caller's preallocated arrays indexed by position & mask.
+ * There is a single consumer; producers are one thread (Single) or any
+ * number of threads (Multi, claims go through a compare-exchange).
+ */
+
+enum class Gym_Producers
+{
+    Single,
+    Multi
+};
+
+class Gym_SlotRing
+{
+public:
+    /** capacity is rounded up to a power of two, 2 at least */
+    Gym_SlotRing(size_t capacity, Gym_Producers producers)
+        :mMask(round_up(capacity) - 1)
+        ,mMulti(Gym_Producers::Multi == producers)
+        ,mvSeq(new std::atomic<uint64_t>[mMask + 1])
+    {
+        for ( size_t i=0; i<=mMask; ++i ) {
+            mvSeq[i].store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t capacity() const { return mMask + 1; }
+    size_t index(uint64_t pos) const { return size_t(pos) & mMask; }
+
+    /** Producer: reserve the slot at pos; false when the ring is full */
+    bool try_claim(uint64_t &pos)
+    {
+        uint64_t p = mTail.load(std::memory_order_relaxed);
+        for (;;) {
+            const uint64_t seq = mvSeq[index(p)].load(std::memory_order_acquire);
+            const int64_t diff = int64_t(seq - p);
+            if ( diff < 0 ) {
+                return false;
+            }
+            if ( 0 == diff ) {
+                if ( !mMulti ) {
+                    mTail.store(p + 1, std::memory_order_relaxed);
+                    pos = p;
+                    return true;
+                }
+                if ( mTail.compare_exchange_weak(p, p + 1, std::memory_order_relaxed) ) {
+                    pos = p;
+                    return true;
+                }
+            } else {
+                p = mTail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /** Producer: the slot at pos is filled */
+    void publish(uint64_t pos)
+    {
+        mvSeq[index(pos)].store(pos + 1, std::memory_order_release);
+    }
+
+    /** Consumer: number (up to max) of filled slots in a row starting at first */
+    size_t try_acquire(size_t max, uint64_t &first) const
+    {
+        first = mHead;
+        size_t n = 0;
+        while ( n < max && mvSeq[index(first + n)].load(std::memory_order_acquire) == first + n + 1 ) {
+            ++n;
+        }
+        return n;
+    }
+
+    /** Consumer: the first count acquired slots are free again */
+    void release(size_t count)
+    {
+        for ( size_t k=0; k<count; ++k ) {
+            mvSeq[index(mHead + k)].store(mHead + k + mMask + 1, std::memory_order_release);
+        }
+        mHead += count;
+    }
+
+private:
+    //At least 2: with one slot "filled" (pos + 1) and "free" (pos + capacity) are equal
+    static size_t round_up(size_t n)
+    {
+        size_t p = 2;
+        while ( p < n ) {
+            p <<= 1;
+        }
+        return p;
+    }
+
+    const size_t mMask;
+    const bool mMulti;
+    std::unique_ptr<std::atomic<uint64_t>[]> mvSeq;
+    alignas(64) std::atomic<uint64_t> mTail{0};    //next position to claim
+    alignas(64) uint64_t mHead = 0;                 //next position to consume
+};
+
+/** Queue of copyable items on a Gym_SlotRing */
+template<typename T>
+class Gym_Queue
+{
+public:
+    Gym_Queue(size_t capacity, Gym_Producers producers)
+        :mRing(capacity, producers)
+        ,mvItems(mRing.capacity())
+    {
+    }
+
+    size_t capacity() const { return mRing.capacity(); }
+
+    bool try_push(const T &item)
+    {
+        uint64_t pos;
+        if ( !mRing.try_claim(pos) ) {
+            return false;
+        }
+        mvItems[mRing.index(pos)] = item;
+        mRing.publish(pos);
+        return true;
+    }
+
+    bool try_pop(T &item)
+    {
+        uint64_t pos;
+        if ( 0 == mRing.try_acquire(1, pos) ) {
+            return false;
+        }
+        item = std::move(mvItems[mRing.index(pos)]);
+        mRing.release(1);
+        return true;
+    }
+
+private:
+    Gym_SlotRing mRing;
+    std::vector<T> mvItems;
+};
+
+template<typename T>
+struct Gym_SpscQueue : Gym_Queue<T>
+{
+    explicit Gym_SpscQueue(size_t capacity) : Gym_Queue<T>(capacity, Gym_Producers::Single) {}
+};
+
+template<typename T>
+struct Gym_MpscQueue : Gym_Queue<T>
+{
+    explicit Gym_MpscQueue(size_t capacity) : Gym_Queue<T>(capacity, Gym_Producers::Multi) {}
+};
+
+/** Rows [0, size) hold the transitions of the last pop_batch() */
+struct Gym_TransitionBatch
+{
+    torch::Tensor state;        //[rows, state_dimension] float or uint8
+    torch::Tensor action;       //[rows, action_dimension] float
+    torch::Tensor reward;       //[rows] float
+    torch::Tensor next_state;   //[rows, state_dimension] like state
+    torch::Tensor done;         //[rows] int
+    int size = 0;
+};
+
+/**
+ * (state, action, reward, next_state, done) transitions in preallocated
+ * float slots. Actors copy a transition straight into its slot, the learner
+ * takes whole runs of slots with one memcpy per field (two on wrap-around)
+ * into the contiguous tensors of a Gym_TransitionBatch.
+ * States are kFloat or kUInt8 (stateType), e.g. the byte pixels of
+ * CartPole_ContinousVision::set_state_type(torch::kUInt8), which a replay
+ * buffer can keep as bytes until the model input.
+ */
+class Gym_TransitionQueue
+{
+public:
+    /** Throws std::invalid_argument for a stateType other than kFloat and kUInt8 */
+    Gym_TransitionQueue(size_t capacity, int stateDim, int actionDim,
+                        Gym_Producers producers = Gym_Producers::Multi,
+                        torch::ScalarType stateType = torch::kFloat);
+
+    /**
+     * false when the queue is full, the state pointers must match state_type().
+     * The tensor overload throws c10::Error on a size mismatch or on states
+     * that do not convert to state_type()
+     */
+    bool try_push(const float *state, const float *action, float reward,
+                  const float *nextState, int done);
+    bool try_push(const uint8_t *state, const float *action, float reward,
+                  const uint8_t *nextState, int done);
+    bool try_push(const torch::Tensor &state, const torch::Tensor &action, float reward,
+                  const torch::Tensor &nextState, int done);
+
+    /** Tensors for pop_batch() with room for `rows` transitions */
+    Gym_TransitionBatch make_batch(int rows) const;
+    /** Consumer: move up to batch rows transitions into batch, returns batch.size */
+    int pop_batch(Gym_TransitionBatch &batch);
+
+    size_t capacity() const;
+    int state_dimension() const;
+    int action_dimension() const;
+    torch::ScalarType state_type() const;
+
+private:
+    bool push_bytes(const void *state, const float *action, float reward,
+                    const void *nextState, int done);
+
+    Gym_SlotRing mRing;
+    int mStateDim;
+    int mActionDim;
+    torch::ScalarType mStateType;
+    size_t mStateBytes;                 //bytes per state
+    std::vector<uint8_t> mvState;
+    std::vector<float> mvAction;
+    std::vector<float> mvReward;
+    std::vector<uint8_t> mvNextState;
+    std::vector<int32_t> mvDone;
+};
+
+#endif // GYM_QUEUE_H
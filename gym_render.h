@@ -0,0 +1,37 @@
+#ifndef GYM_RENDER_H
+#define GYM_RENDER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+/** Non-owning view of n contiguous elements (std::span is C++20) */
+template<typename T>
+struct Gym_Span
+{
+    T *data = nullptr;
+    size_t size = 0;
+
+    T& operator[](size_t i) const { return data[i]; }
+    T* begin() const { return data; }
+    T* end() const { return data + size; }
+};
+
+/**
+ * Renders the carts for one frame: positions and angles of every axis in,
+ * width * height RGBA pixels (one 32 bit word each, rows bottom-up as
+ * glReadPixels gives them) written straight into the caller's buffer.
+ */
+using Gym_Render_Callback = std::function<void(Gym_Span<const double> pos,
+                                               Gym_Span<const double> ang,
+                                               Gym_Span<uint32_t> rgba)>;
+
+/**
+ * As Gym_Render_Callback, but only the two channels the env keeps: width *
+ * height (ambient, depth) byte pairs, half the bytes of an RGBA frame.
+ */
+using Gym_Render_Callback_RG = std::function<void(Gym_Span<const double> pos,
+                                                  Gym_Span<const double> ang,
+                                                  Gym_Span<uint8_t> rg)>;
+
+#endif // GYM_RENDER_H
@@ -0,0 +1,88 @@
+#ifndef GYM_RNG_H
+#define GYM_RNG_H
+
+#include <cmath>
+#include <cstdint>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/**
+ * Counter-based random numbers (Philox4x32-10, Salmon et al., "Parallel
+ * random numbers: as easy as 1, 2, 3", SC'11) for the environments.
+ * A draw is a pure function of the 64 bit seed and the counter
+ * (env_id, episode, step, block), so there is no generator state to share
+ * or lock and results do not depend on which thread draws them, or when.
+ */
+
+/** What a block of draws is used for, kept in the top byte of the block */
+enum class Gym_Rng_Stream : uint32_t
+{
+    Reset = 0,
+    Action = 1
+};
+
+struct Gym_Rng_Counter
+{
+    uint32_t env_id;
+    uint32_t episode;
+    uint32_t step;
+    uint32_t block;
+};
+
+inline uint32_t gym_rng_block(Gym_Rng_Stream stream, uint32_t index)
+{
+    return (uint32_t(stream) << 24) | (index & 0xFFFFFFu);
+}
+
+/** 128 random bits for the given seed and counter */
+inline void gym_philox4x32(uint64_t seed, const Gym_Rng_Counter &ctr, uint32_t out[4])
+{
+    uint32_t k0 = uint32_t(seed);
+    uint32_t k1 = uint32_t(seed >> 32);
+    uint32_t c0 = ctr.env_id;
+    uint32_t c1 = ctr.episode;
+    uint32_t c2 = ctr.step;
+    uint32_t c3 = ctr.block;
+
+    for ( int r=0; r<10; ++r ) {
+        const uint64_t p0 = uint64_t(0xD2511F53u) * c0;
+        const uint64_t p1 = uint64_t(0xCD9E8D57u) * c2;
+        const uint32_t n0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+        const uint32_t n2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+        c1 = uint32_t(p1);
+        c3 = uint32_t(p0);
+        c0 = n0;
+        c2 = n2;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+/** Two uniforms in [0, 1) with 53 random bits each from one block */
+inline void gym_rng_uniform2(uint64_t seed, const Gym_Rng_Counter &ctr, double u[2])
+{
+    uint32_t w[4];
+    gym_philox4x32(seed, ctr, w);
+    const double scale = 1.0 / 9007199254740992.0;  //2^-53
+    u[0] = double(((uint64_t(w[0]) << 32) | w[1]) >> 11) * scale;
+    u[1] = double(((uint64_t(w[2]) << 32) | w[3]) >> 11) * scale;
+}
+
+/** Two independent N(0, 1) from one block (Box-Muller) */
+inline void gym_rng_normal2(uint64_t seed, const Gym_Rng_Counter &ctr, double n[2])
+{
+    double u[2];
+    gym_rng_uniform2(seed, ctr, u);
+    const double r = std::sqrt(-2.0 * std::log(1.0 - u[0]));   //1 - u is in (0, 1]
+    const double a = 2.0 * M_PI * u[1];
+    n[0] = r * std::cos(a);
+    n[1] = r * std::sin(a);
+}
+
+#endif // GYM_RNG_H
@@ -0,0 +1,171 @@
+#include <cmath>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "gym_simd.h"
+#include "gym_simd_kernel.h"
+
+namespace {
+
+/** One lane per "vector", used as the portable reference path */
+template<typename T>
+struct V_Scalar
+{
+    using scalar = T;
+    using mask = bool;
+    static constexpr int width = 1;
+
+    T v;
+
+    static V_Scalar load(const T *p) { return {*p}; }
+    static void store(T *p, V_Scalar a) { *p = a.v; }
+    static V_Scalar set1(T a) { return {a}; }
+    static mask lt(V_Scalar a, V_Scalar b) { return a.v < b.v; }
+    static mask gt(V_Scalar a, V_Scalar b) { return a.v > b.v; }
+    static mask mask_or(mask a, mask b) { return a || b; }
+    static unsigned mask_bits(mask a) { return a ? 1u : 0u; }
+    static mask mask_from_bits(unsigned bits) { return bits != 0; }
+    static V_Scalar round(V_Scalar a) { return {std::nearbyint(a.v)}; }
+    static V_Scalar floor(V_Scalar a) { return {std::floor(a.v)}; }
+    static V_Scalar select(mask m, V_Scalar a, V_Scalar b) { return m ? a : b; }
+};
+
+template<typename T>
+inline V_Scalar<T> operator+(V_Scalar<T> a, V_Scalar<T> b) { return {a.v + b.v}; }
+template<typename T>
+inline V_Scalar<T> operator-(V_Scalar<T> a, V_Scalar<T> b) { return {a.v - b.v}; }
+template<typename T>
+inline V_Scalar<T> operator*(V_Scalar<T> a, V_Scalar<T> b) { return {a.v * b.v}; }
+template<typename T>
+inline V_Scalar<T> operator/(V_Scalar<T> a, V_Scalar<T> b) { return {a.v / b.v}; }
+
+template<typename T>
+inline void gym_sincos(V_Scalar<T> a, V_Scalar<T> &s, V_Scalar<T> &c)
+{
+    s.v = std::sin(a.v);
+    c.v = std::cos(a.v);
+}
+
+bool cpu_has_avx2()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("avx2");
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    int info[4];
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    if ( !osxsave || (_xgetbv(0) & 0x6) != 0x6 ) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return false;
+#endif
+}
+
+bool cpu_has_avx512()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("avx512f");
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    int info[4];
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    if ( !osxsave || (_xgetbv(0) & 0xe6) != 0xe6 ) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 16)) != 0;
+#else
+    return false;
+#endif
+}
+
+}
+
+bool gym_isa_supported(Gym_ISA isa)
+{
+    switch ( isa ) {
+    case Gym_ISA::Scalar:
+        return true;
+    case Gym_ISA::AVX2:
+        return cpu_has_avx2();
+    case Gym_ISA::AVX512:
+        return cpu_has_avx512();
+    }
+    return false;
+}
+
+Gym_ISA gym_best_isa()
+{
+    static const Gym_ISA best = gym_isa_supported(Gym_ISA::AVX512) ? Gym_ISA::AVX512 :
+                                gym_isa_supported(Gym_ISA::AVX2) ? Gym_ISA::AVX2 :
+                                                                   Gym_ISA::Scalar;
+    return best;
+}
+
+const char* gym_isa_name(Gym_ISA isa)
+{
+    switch ( isa ) {
+    case Gym_ISA::Scalar:
+        return "scalar";
+    case Gym_ISA::AVX2:
+        return "avx2";
+    case Gym_ISA::AVX512:
+        return "avx512";
+    }
+    return "unknown";
+}
+
+const char* gym_sincos_name(Sincos_Mode mode)
+{
+    switch ( mode ) {
+    case Sincos_Mode::Libm:
+        return "libm";
+    case Sincos_Mode::Fast:
+        return "fast";
+    case Sincos_Mode::Precise:
+        return "precise";
+    }
+    return "unknown";
+}
+
+template<typename T>
+CartPole_Kernel<T> cartpole_kernel(Gym_ISA isa, Kinematics_Integrator integrator, Sincos_Mode mode)
+{
+    if ( !gym_isa_supported(isa) ) {
+        isa = Gym_ISA::Scalar;
+    }
+    switch ( isa ) {
+    case Gym_ISA::AVX2:
+        return cartpole_kernel_avx2<T>(integrator, mode);
+    case Gym_ISA::AVX512:
+        return cartpole_kernel_avx512<T>(integrator, mode);
+    default:
+        return cartpole_kernel_for<V_Scalar<T>>(integrator, mode);
+    }
+}
+
+template<typename T>
+Sincos_Kernel<T> sincos_kernel(Gym_ISA isa, Sincos_Mode mode)
+{
+    if ( !gym_isa_supported(isa) ) {
+        isa = Gym_ISA::Scalar;
+    }
+    switch ( isa ) {
+    case Gym_ISA::AVX2:
+        return sincos_kernel_avx2<T>(mode);
+    case Gym_ISA::AVX512:
+        return sincos_kernel_avx512<T>(mode);
+    default:
+        return sincos_kernel_for<V_Scalar<T>>(mode);
+    }
+}
+
+template CartPole_Kernel<double> cartpole_kernel<double>(Gym_ISA, Kinematics_Integrator, Sincos_Mode);
+template CartPole_Kernel<float> cartpole_kernel<float>(Gym_ISA, Kinematics_Integrator, Sincos_Mode);
+template Sincos_Kernel<double> sincos_kernel<double>(Gym_ISA, Sincos_Mode);
+template Sincos_Kernel<float> sincos_kernel<float>(Gym_ISA, Sincos_Mode);
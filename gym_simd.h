@@ -0,0 +1,92 @@
+#ifndef GYM_SIMD_H
+#define GYM_SIMD_H
+
+#include <cstdint>
+#include "gym_physics.h"
+
+/**
+ * Vectorized cart-pole kernels for the batched environments.
+ * The kernels are built for several instruction sets and the best one
+ * supported by the running CPU is picked at runtime.
+ */
+enum class Gym_ISA
+{
+    Scalar = 0,
+    AVX2,
+    AVX512
+};
+
+/** Lane counts handed to the kernels must be a multiple of this. The widest
+ *  kernel (AVX-512 on float) processes 16 lanes per iteration.
+ */
+constexpr int gym_lane_padding = 16;
+
+inline int gym_pad_lanes(int n)
+{
+    return (n + gym_lane_padding - 1) / gym_lane_padding * gym_lane_padding;
+}
+
+bool gym_isa_supported(Gym_ISA isa);
+Gym_ISA gym_best_isa();
+const char* gym_isa_name(Gym_ISA isa);
+
+/**
+ * One axis of n environments in struct-of-arrays layout.
+ * The kernel advances every lane by CartPole_Physics::substep_tau() under
+ * "force" (already scaled by force_mag) and ORs the continuous termination
+ * test into "done". Lanes whose done byte is already set are left as they
+ * are, so calling the kernel once per substep stops each lane at the substep
+ * it failed.
+ */
+template<typename T>
+struct CartPole_Lanes
+{
+    T *x;
+    T *x_dot;
+    T *theta;
+    T *theta_dot;
+    const T *force;
+    uint8_t *done;
+    int n;
+};
+
+/**
+ * sin/cos used by the kernels. Libm matches the single environment classes
+ * bit for bit, the polynomial modes stay in vector registers. Max absolute
+ * error against libm for |x| <= 1e5 (gym_bench checks them):
+ *   Fast     1e-7   (degree 9 sin / degree 8 cos)
+ *   Precise  1e-12  (degree 13 sin / degree 14 cos)
+ */
+enum class Sincos_Mode
+{
+    Libm = 0,
+    Fast,
+    Precise
+};
+
+const char* gym_sincos_name(Sincos_Mode mode);
+
+/**
+ * Kernels exist for T = double and T = float. The float kernels process
+ * twice the lanes per instruction (8 on AVX2, 16 on AVX-512) and move half
+ * the bytes; their sin/cos modes are bounded by float rounding (~1e-7).
+ */
+template<typename T>
+using CartPole_Kernel = void (*)(const CartPole_Physics &physics,
+                                 const CartPole_Lanes<T> &lanes);
+
+/** Kernel for the given instruction set, integrator and sin/cos mode,
+ *  falls back to Scalar if the ISA is unsupported.
+ */
+template<typename T>
+CartPole_Kernel<T> cartpole_kernel(Gym_ISA isa, Kinematics_Integrator integrator,
+                                   Sincos_Mode mode = Sincos_Mode::Libm);
+
+/** sin/cos of n values (n a multiple of gym_lane_padding) */
+template<typename T>
+using Sincos_Kernel = void (*)(const T *x, T *s, T *c, int n);
+
+template<typename T>
+Sincos_Kernel<T> sincos_kernel(Gym_ISA isa, Sincos_Mode mode);
+
+#endif // GYM_SIMD_H
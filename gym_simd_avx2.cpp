@@ -0,0 +1,155 @@
+#include <cmath>
+#include "gym_simd.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+
+#include <immintrin.h>
+
+//Everything below is built for AVX2 only; FMA stays off so lanes round
+//exactly like the scalar path.
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include "gym_simd_kernel.h"
+
+namespace {
+
+struct V_AVX2d
+{
+    using scalar = double;
+    using mask = __m256d;
+    static constexpr int width = 4;
+
+    __m256d v;
+
+    static V_AVX2d load(const double *p) { return {_mm256_loadu_pd(p)}; }
+    static void store(double *p, V_AVX2d a) { _mm256_storeu_pd(p, a.v); }
+    static V_AVX2d set1(double a) { return {_mm256_set1_pd(a)}; }
+    static mask lt(V_AVX2d a, V_AVX2d b) { return _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ); }
+    static mask gt(V_AVX2d a, V_AVX2d b) { return _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ); }
+    static mask mask_or(mask a, mask b) { return _mm256_or_pd(a, b); }
+    static unsigned mask_bits(mask a) { return unsigned(_mm256_movemask_pd(a)); }
+    static mask mask_from_bits(unsigned bits)
+    {
+        const __m256i lane = _mm256_setr_epi64x(1, 2, 4, 8);
+        const __m256i set = _mm256_and_si256(_mm256_set1_epi64x(bits), lane);
+        return _mm256_castsi256_pd(_mm256_cmpeq_epi64(set, lane));
+    }
+    static V_AVX2d round(V_AVX2d a) { return {_mm256_round_pd(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)}; }
+    static V_AVX2d floor(V_AVX2d a) { return {_mm256_floor_pd(a.v)}; }
+    static V_AVX2d select(mask m, V_AVX2d a, V_AVX2d b) { return {_mm256_blendv_pd(b.v, a.v, m)}; }
+};
+
+inline V_AVX2d operator+(V_AVX2d a, V_AVX2d b) { return {_mm256_add_pd(a.v, b.v)}; }
+inline V_AVX2d operator-(V_AVX2d a, V_AVX2d b) { return {_mm256_sub_pd(a.v, b.v)}; }
+inline V_AVX2d operator*(V_AVX2d a, V_AVX2d b) { return {_mm256_mul_pd(a.v, b.v)}; }
+inline V_AVX2d operator/(V_AVX2d a, V_AVX2d b) { return {_mm256_div_pd(a.v, b.v)}; }
+
+inline void gym_sincos(V_AVX2d a, V_AVX2d &s, V_AVX2d &c)
+{
+    alignas(32) double t[4], ts[4], tc[4];
+    _mm256_store_pd(t, a.v);
+    for ( int k=0; k<4; ++k ) {
+        ts[k] = std::sin(t[k]);
+        tc[k] = std::cos(t[k]);
+    }
+    s.v = _mm256_load_pd(ts);
+    c.v = _mm256_load_pd(tc);
+}
+
+struct V_AVX2f
+{
+    using scalar = float;
+    using mask = __m256;
+    static constexpr int width = 8;
+
+    __m256 v;
+
+    static V_AVX2f load(const float *p) { return {_mm256_loadu_ps(p)}; }
+    static void store(float *p, V_AVX2f a) { _mm256_storeu_ps(p, a.v); }
+    static V_AVX2f set1(float a) { return {_mm256_set1_ps(a)}; }
+    static mask lt(V_AVX2f a, V_AVX2f b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+    static mask gt(V_AVX2f a, V_AVX2f b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+    static mask mask_or(mask a, mask b) { return _mm256_or_ps(a, b); }
+    static unsigned mask_bits(mask a) { return unsigned(_mm256_movemask_ps(a)); }
+    static mask mask_from_bits(unsigned bits)
+    {
+        const __m256i lane = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        const __m256i set = _mm256_and_si256(_mm256_set1_epi32(int(bits)), lane);
+        return _mm256_castsi256_ps(_mm256_cmpeq_epi32(set, lane));
+    }
+    static V_AVX2f round(V_AVX2f a) { return {_mm256_round_ps(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)}; }
+    static V_AVX2f floor(V_AVX2f a) { return {_mm256_floor_ps(a.v)}; }
+    static V_AVX2f select(mask m, V_AVX2f a, V_AVX2f b) { return {_mm256_blendv_ps(b.v, a.v, m)}; }
+};
+
+inline V_AVX2f operator+(V_AVX2f a, V_AVX2f b) { return {_mm256_add_ps(a.v, b.v)}; }
+inline V_AVX2f operator-(V_AVX2f a, V_AVX2f b) { return {_mm256_sub_ps(a.v, b.v)}; }
+inline V_AVX2f operator*(V_AVX2f a, V_AVX2f b) { return {_mm256_mul_ps(a.v, b.v)}; }
+inline V_AVX2f operator/(V_AVX2f a, V_AVX2f b) { return {_mm256_div_ps(a.v, b.v)}; }
+
+inline void gym_sincos(V_AVX2f a, V_AVX2f &s, V_AVX2f &c)
+{
+    alignas(32) float t[8], ts[8], tc[8];
+    _mm256_store_ps(t, a.v);
+    for ( int k=0; k<8; ++k ) {
+        ts[k] = std::sin(t[k]);
+        tc[k] = std::cos(t[k]);
+    }
+    s.v = _mm256_load_ps(ts);
+    c.v = _mm256_load_ps(tc);
+}
+
+template<typename T> struct Lanes_AVX2;
+template<> struct Lanes_AVX2<double> { using type = V_AVX2d; };
+template<> struct Lanes_AVX2<float> { using type = V_AVX2f; };
+
+}
+
+template<typename T>
+CartPole_Kernel<T> cartpole_kernel_avx2(Kinematics_Integrator integrator, Sincos_Mode mode)
+{
+    return cartpole_kernel_for<typename Lanes_AVX2<T>::type>(integrator, mode);
+}
+
+template<typename T>
+Sincos_Kernel<T> sincos_kernel_avx2(Sincos_Mode mode)
+{
+    return sincos_kernel_for<typename Lanes_AVX2<T>::type>(mode);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#else
+
+#include "gym_simd_kernel.h"
+
+//Not an x86 build, gym_isa_supported() never selects these kernels
+template<typename T>
+CartPole_Kernel<T> cartpole_kernel_avx2(Kinematics_Integrator, Sincos_Mode)
+{
+    return nullptr;
+}
+
+template<typename T>
+Sincos_Kernel<T> sincos_kernel_avx2(Sincos_Mode)
+{
+    return nullptr;
+}
+
+#endif
+
+template CartPole_Kernel<double> cartpole_kernel_avx2<double>(Kinematics_Integrator, Sincos_Mode);
+template CartPole_Kernel<float> cartpole_kernel_avx2<float>(Kinematics_Integrator, Sincos_Mode);
+template Sincos_Kernel<double> sincos_kernel_avx2<double>(Sincos_Mode);
+template Sincos_Kernel<float> sincos_kernel_avx2<float>(Sincos_Mode);
@@ -0,0 +1,145 @@
+#include <cmath>
+#include "gym_simd.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+
+#include <immintrin.h>
+
+//Everything below is built for AVX-512F only; FMA stays off so lanes round
+//exactly like the scalar path.
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f"))), apply_to = function)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include "gym_simd_kernel.h"
+
+namespace {
+
+struct V_AVX512d
+{
+    using scalar = double;
+    using mask = __mmask8;
+    static constexpr int width = 8;
+
+    __m512d v;
+
+    static V_AVX512d load(const double *p) { return {_mm512_loadu_pd(p)}; }
+    static void store(double *p, V_AVX512d a) { _mm512_storeu_pd(p, a.v); }
+    static V_AVX512d set1(double a) { return {_mm512_set1_pd(a)}; }
+    static mask lt(V_AVX512d a, V_AVX512d b) { return _mm512_cmp_pd_mask(a.v, b.v, _CMP_LT_OQ); }
+    static mask gt(V_AVX512d a, V_AVX512d b) { return _mm512_cmp_pd_mask(a.v, b.v, _CMP_GT_OQ); }
+    static mask mask_or(mask a, mask b) { return mask(a | b); }
+    static unsigned mask_bits(mask a) { return unsigned(a); }
+    static mask mask_from_bits(unsigned bits) { return mask(bits); }
+    static V_AVX512d round(V_AVX512d a) { return {_mm512_mask_roundscale_pd(a.v, 0xFF, a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)}; }
+    static V_AVX512d floor(V_AVX512d a) { return {_mm512_mask_roundscale_pd(a.v, 0xFF, a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)}; }
+    static V_AVX512d select(mask m, V_AVX512d a, V_AVX512d b) { return {_mm512_mask_blend_pd(m, b.v, a.v)}; }
+};
+
+inline V_AVX512d operator+(V_AVX512d a, V_AVX512d b) { return {_mm512_add_pd(a.v, b.v)}; }
+inline V_AVX512d operator-(V_AVX512d a, V_AVX512d b) { return {_mm512_sub_pd(a.v, b.v)}; }
+inline V_AVX512d operator*(V_AVX512d a, V_AVX512d b) { return {_mm512_mul_pd(a.v, b.v)}; }
+inline V_AVX512d operator/(V_AVX512d a, V_AVX512d b) { return {_mm512_div_pd(a.v, b.v)}; }
+
+inline void gym_sincos(V_AVX512d a, V_AVX512d &s, V_AVX512d &c)
+{
+    alignas(64) double t[8], ts[8], tc[8];
+    _mm512_store_pd(t, a.v);
+    for ( int k=0; k<8; ++k ) {
+        ts[k] = std::sin(t[k]);
+        tc[k] = std::cos(t[k]);
+    }
+    s.v = _mm512_load_pd(ts);
+    c.v = _mm512_load_pd(tc);
+}
+
+struct V_AVX512f
+{
+    using scalar = float;
+    using mask = __mmask16;
+    static constexpr int width = 16;
+
+    __m512 v;
+
+    static V_AVX512f load(const float *p) { return {_mm512_loadu_ps(p)}; }
+    static void store(float *p, V_AVX512f a) { _mm512_storeu_ps(p, a.v); }
+    static V_AVX512f set1(float a) { return {_mm512_set1_ps(a)}; }
+    static mask lt(V_AVX512f a, V_AVX512f b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); }
+    static mask gt(V_AVX512f a, V_AVX512f b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ); }
+    static mask mask_or(mask a, mask b) { return mask(a | b); }
+    static unsigned mask_bits(mask a) { return unsigned(a); }
+    static mask mask_from_bits(unsigned bits) { return mask(bits); }
+    static V_AVX512f round(V_AVX512f a) { return {_mm512_mask_roundscale_ps(a.v, 0xFFFF, a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)}; }
+    static V_AVX512f floor(V_AVX512f a) { return {_mm512_mask_roundscale_ps(a.v, 0xFFFF, a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)}; }
+    static V_AVX512f select(mask m, V_AVX512f a, V_AVX512f b) { return {_mm512_mask_blend_ps(m, b.v, a.v)}; }
+};
+
+inline V_AVX512f operator+(V_AVX512f a, V_AVX512f b) { return {_mm512_add_ps(a.v, b.v)}; }
+inline V_AVX512f operator-(V_AVX512f a, V_AVX512f b) { return {_mm512_sub_ps(a.v, b.v)}; }
+inline V_AVX512f operator*(V_AVX512f a, V_AVX512f b) { return {_mm512_mul_ps(a.v, b.v)}; }
+inline V_AVX512f operator/(V_AVX512f a, V_AVX512f b) { return {_mm512_div_ps(a.v, b.v)}; }
+
+inline void gym_sincos(V_AVX512f a, V_AVX512f &s, V_AVX512f &c)
+{
+    alignas(64) float t[16], ts[16], tc[16];
+    _mm512_store_ps(t, a.v);
+    for ( int k=0; k<16; ++k ) {
+        ts[k] = std::sin(t[k]);
+        tc[k] = std::cos(t[k]);
+    }
+    s.v = _mm512_load_ps(ts);
+    c.v = _mm512_load_ps(tc);
+}
+
+template<typename T> struct Lanes_AVX512;
+template<> struct Lanes_AVX512<double> { using type = V_AVX512d; };
+template<> struct Lanes_AVX512<float> { using type = V_AVX512f; };
+
+}
+
+template<typename T>
+CartPole_Kernel<T> cartpole_kernel_avx512(Kinematics_Integrator integrator, Sincos_Mode mode)
+{
+    return cartpole_kernel_for<typename Lanes_AVX512<T>::type>(integrator, mode);
+}
+
+template<typename T>
+Sincos_Kernel<T> sincos_kernel_avx512(Sincos_Mode mode)
+{
+    return sincos_kernel_for<typename Lanes_AVX512<T>::type>(mode);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#else
+
+#include "gym_simd_kernel.h"
+
+//Not an x86 build, gym_isa_supported() never selects these kernels
+template<typename T>
+CartPole_Kernel<T> cartpole_kernel_avx512(Kinematics_Integrator, Sincos_Mode)
+{
+    return nullptr;
+}
+
+template<typename T>
+Sincos_Kernel<T> sincos_kernel_avx512(Sincos_Mode)
+{
+    return nullptr;
+}
+
+#endif
+
+template CartPole_Kernel<double> cartpole_kernel_avx512<double>(Kinematics_Integrator, Sincos_Mode);
+template CartPole_Kernel<float> cartpole_kernel_avx512<float>(Kinematics_Integrator, Sincos_Mode);
+template Sincos_Kernel<double> sincos_kernel_avx512<double>(Sincos_Mode);
+template Sincos_Kernel<float> sincos_kernel_avx512<float>(Sincos_Mode);
@@ -0,0 +1,220 @@
+#ifndef GYM_SIMD_KERNEL_H
+#define GYM_SIMD_KERNEL_H
+
+/**
+ * ISA independent body of the cart-pole kernels. Each gym_simd*.cpp
+ * includes this after selecting its target and instantiates it with its
+ * own vector type V, which provides:
+ *   V::width, V::scalar, V::mask
+ *   V::load / V::store / V::set1, + - * /, V::lt / V::gt / V::mask_or
+ *   V::round / V::floor / V::select, V::mask_bits(mask) / V::mask_from_bits(bits)
+ *   and a gym_sincos(v, sin, cos) (libm) found by ADL
+ *
+ * The arithmetic is the same CartPole_Accel / integrator policy code as
+ * CartPole_Physics::step_axis() and the callers disable FP contraction, so
+ * every ISA produces bit-identical results to the single environment classes
+ * (and to each other for the polynomial sin/cos modes).
+ */
+
+//Entry points of gym_simd_avx2.cpp / gym_simd_avx512.cpp, built for float and double
+template<typename T> CartPole_Kernel<T> cartpole_kernel_avx2(Kinematics_Integrator integrator, Sincos_Mode mode);
+template<typename T> CartPole_Kernel<T> cartpole_kernel_avx512(Kinematics_Integrator integrator, Sincos_Mode mode);
+template<typename T> Sincos_Kernel<T> sincos_kernel_avx2(Sincos_Mode mode);
+template<typename T> Sincos_Kernel<T> sincos_kernel_avx512(Sincos_Mode mode);
+
+/** pi/2 split in three parts whose products with small integers are exact */
+template<typename T>
+struct Sincos_Reduction;
+
+template<>
+struct Sincos_Reduction<double>
+{
+    static constexpr double pio2_1 = 1.57079632673412561417e+00;
+    static constexpr double pio2_2 = 6.07710050630396597660e-11;
+    static constexpr double pio2_3 = 2.02226624871116645580e-21;
+};
+
+template<>
+struct Sincos_Reduction<float>
+{
+    static constexpr float pio2_1 = 1.5703125f;
+    static constexpr float pio2_2 = 4.837512969970703125e-4f;
+    static constexpr float pio2_3 = 7.54978995489188216e-8f;
+};
+
+/**
+ * Polynomial sin/cos. The argument is reduced to r in [-pi/4, pi/4] with a
+ * three part (Cody-Waite) pi/2, then Taylor polynomials in r^2 are evaluated
+ * and swapped/negated according to the quadrant.
+ */
+template<bool Precise>
+struct Sincos_Poly
+{
+    template<class V>
+    static void apply(const V &a, V &s, V &c)
+    {
+        using T = typename V::scalar;
+
+        const V q = V::round(a * V::set1(T(0.63661977236758134308)));   // 2/pi
+        const V r = a - q * V::set1(Sincos_Reduction<T>::pio2_1)
+                      - q * V::set1(Sincos_Reduction<T>::pio2_2)
+                      - q * V::set1(Sincos_Reduction<T>::pio2_3);
+        const V r2 = r * r;
+
+        V ps, pc;
+        if constexpr ( Precise ) {
+            ps = V::set1(T(1.0 / 6227020800.0));
+            ps = ps * r2 + V::set1(T(-1.0 / 39916800.0));
+            ps = ps * r2 + V::set1(T(1.0 / 362880.0));
+            ps = ps * r2 + V::set1(T(-1.0 / 5040.0));
+            ps = ps * r2 + V::set1(T(1.0 / 120.0));
+            ps = ps * r2 + V::set1(T(-1.0 / 6.0));
+
+            pc = V::set1(T(-1.0 / 87178291200.0));
+            pc = pc * r2 + V::set1(T(1.0 / 479001600.0));
+            pc = pc * r2 + V::set1(T(-1.0 / 3628800.0));
+            pc = pc * r2 + V::set1(T(1.0 / 40320.0));
+            pc = pc * r2 + V::set1(T(-1.0 / 720.0));
+            pc = pc * r2 + V::set1(T(1.0 / 24.0));
+            pc = pc * r2 + V::set1(T(-0.5));
+        } else {
+            ps = V::set1(T(1.0 / 362880.0));
+            ps = ps * r2 + V::set1(T(-1.0 / 5040.0));
+            ps = ps * r2 + V::set1(T(1.0 / 120.0));
+            ps = ps * r2 + V::set1(T(-1.0 / 6.0));
+
+            pc = V::set1(T(1.0 / 40320.0));
+            pc = pc * r2 + V::set1(T(-1.0 / 720.0));
+            pc = pc * r2 + V::set1(T(1.0 / 24.0));
+            pc = pc * r2 + V::set1(T(-0.5));
+        }
+        const V sr = r + r * r2 * ps;
+        const V cr = V::set1(T(1)) + r2 * pc;
+
+        //Quadrant q mod 4: odd quadrants swap sin/cos, sin is negative in
+        //quadrants 2 and 3, cos in quadrants 1 and 2 (= sin of quadrant + 1)
+        const V quarter = V::set1(T(0.25));
+        const V four = V::set1(T(4));
+        const V qs = q - four * V::floor(q * quarter);
+        const V qc = (qs + V::set1(T(1))) - four * V::floor((qs + V::set1(T(1))) * quarter);
+        const V half = V::set1(T(0.5));
+        const auto odd = V::gt(qs - V::set1(T(2)) * V::floor(qs * half), half);
+        const V zero = V::set1(T(0));
+        const V s_abs = V::select(odd, cr, sr);
+        const V c_abs = V::select(odd, sr, cr);
+        s = V::select(V::gt(qs, V::set1(T(1.5))), zero - s_abs, s_abs);
+        c = V::select(V::gt(qc, V::set1(T(1.5))), zero - c_abs, c_abs);
+    }
+};
+
+template<class V, class S>
+void sincos_lanes(const typename V::scalar *x, typename V::scalar *s, typename V::scalar *c, int n)
+{
+    for ( int i=0; i<n; i+=V::width ) {
+        V vs, vc;
+        S::apply(V::load(x + i), vs, vc);
+        V::store(s + i, vs);
+        V::store(c + i, vc);
+    }
+}
+
+template<class V, class I, class S>
+void cartpole_lanes(const CartPole_Physics &p, const CartPole_Lanes<typename V::scalar> &l)
+{
+    using T = typename V::scalar;
+
+    const double tau = p.substep_tau();
+    const Integrator_Step<V> h{V::set1(T(tau)), V::set1(T(0.5 * tau)), V::set1(T(tau / 6.0))};
+    CartPole_Accel<V, S> accel{V::set1(T(0)), V::set1(T(p.gravity)), V::set1(T(p.masspole)),
+                            V::set1(T(p.total_mass)), V::set1(T(p.length)),
+                            V::set1(T(p.polemass_length)), V::set1(T(4.0 / 3.0))};
+    const V two_length = V::set1(T(2*p.length));
+    const V x_hi = V::set1(T(p.x_threshold));
+    const V x_lo = V::set1(T(-p.x_threshold));
+    const V theta_hi = V::set1(T(p.theta_threshold_radians));
+    const V theta_lo = V::set1(T(-p.theta_threshold_radians));
+
+    for ( int n=0; n<l.n; n+=V::width ) {
+        V x = V::load(l.x + n);
+        V x_dot = V::load(l.x_dot + n);
+        V theta = V::load(l.theta + n);
+        V theta_dot = V::load(l.theta_dot + n);
+        accel.force = V::load(l.force + n);
+
+        unsigned frozen = 0;
+        for ( int k=0; k<V::width; ++k ) {
+            frozen |= unsigned(0 != l.done[n + k]) << k;
+        }
+
+        if ( frozen ) {
+            const V x0 = x, x_dot0 = x_dot, theta0 = theta, theta_dot0 = theta_dot;
+            I::advance(x, x_dot, theta, theta_dot, h, accel);
+
+            const auto m = V::mask_from_bits(frozen);
+            x = V::select(m, x0, x);
+            x_dot = V::select(m, x_dot0, x_dot);
+            theta = V::select(m, theta0, theta);
+            theta_dot = V::select(m, theta_dot0, theta_dot);
+        } else {
+            I::advance(x, x_dot, theta, theta_dot, h, accel);
+        }
+
+        V::store(l.x + n, x);
+        V::store(l.x_dot + n, x_dot);
+        V::store(l.theta + n, theta);
+        V::store(l.theta_dot + n, theta_dot);
+
+        V sintip, costip;
+        S::apply(theta, sintip, costip);
+        const V x_tip = two_length * sintip + x;
+
+        const auto out = V::mask_or(V::mask_or(V::mask_or(V::lt(x, x_lo), V::gt(x, x_hi)),
+                                               V::mask_or(V::lt(theta, theta_lo), V::gt(theta, theta_hi))),
+                                    V::mask_or(V::lt(x_tip, x_lo), V::gt(x_tip, x_hi)));
+        const unsigned bits = V::mask_bits(out);
+        for ( int k=0; k<V::width; ++k ) {
+            l.done[n + k] |= (bits >> k) & 1u;
+        }
+    }
+}
+
+template<class V, class S>
+CartPole_Kernel<typename V::scalar> cartpole_kernel_for(Kinematics_Integrator integrator)
+{
+    switch ( integrator ) {
+    case Kinematics_Integrator::Semi_Implicit_Euler:
+        return cartpole_lanes<V, Integrator_Semi_Implicit_Euler, S>;
+    case Kinematics_Integrator::RK4:
+        return cartpole_lanes<V, Integrator_RK4, S>;
+    default:
+        return cartpole_lanes<V, Integrator_Euler, S>;
+    }
+}
+
+template<class V>
+CartPole_Kernel<typename V::scalar> cartpole_kernel_for(Kinematics_Integrator integrator, Sincos_Mode mode)
+{
+    switch ( mode ) {
+    case Sincos_Mode::Fast:
+        return cartpole_kernel_for<V, Sincos_Poly<false>>(integrator);
+    case Sincos_Mode::Precise:
+        return cartpole_kernel_for<V, Sincos_Poly<true>>(integrator);
+    default:
+        return cartpole_kernel_for<V, Sincos_Libm>(integrator);
+    }
+}
+
+template<class V>
+Sincos_Kernel<typename V::scalar> sincos_kernel_for(Sincos_Mode mode)
+{
+    switch ( mode ) {
+    case Sincos_Mode::Fast:
+        return sincos_lanes<V, Sincos_Poly<false>>;
+    case Sincos_Mode::Precise:
+        return sincos_lanes<V, Sincos_Poly<true>>;
+    default:
+        return sincos_lanes<V, Sincos_Libm>;
+    }
+}
+
+#endif // GYM_SIMD_KERNEL_H
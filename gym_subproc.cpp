@@ -0,0 +1,584 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "gym_subproc.h"
+
+#if defined(__linux__)
+
+#include <climits>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+const int kCommandRing = 16;
+
+//Shared (not FUTEX_PRIVATE) operations, the words are mapped by several processes
+bool futex_wait(std::atomic<uint32_t> &word, uint32_t expected, int timeoutMs)
+{
+    timespec ts;
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = long(timeoutMs % 1000) * 1000000L;
+    return 0 == syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected,
+                        0 <= timeoutMs ? &ts : nullptr, nullptr, 0);
+}
+
+void futex_wake(std::atomic<uint32_t> &word)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+//a was posted/done after b, sequence numbers wrap
+bool seq_after(uint32_t a, uint32_t b)
+{
+    return 0 < int32_t(a - b);
+}
+
+size_t align64(size_t bytes)
+{
+    return (bytes + 63) & ~size_t(63);
+}
+
+void report_error(char (&dst)[256], const char *what)
+{
+    std::strncpy(dst, what, sizeof(dst) - 1);
+    dst[sizeof(dst) - 1] = 0;
+}
+
+//Threads of this process, from /proc/self/status; 0 when unknown
+int thread_count()
+{
+    FILE *f = std::fopen("/proc/self/status", "r");
+    if ( !f ) {
+        return 0;
+    }
+    char line[256];
+    int threads = 0;
+    while ( std::fgets(line, sizeof(line), f) ) {
+        if ( 1 == std::sscanf(line, "Threads: %d", &threads) ) {
+            break;
+        }
+    }
+    std::fclose(f);
+    return threads;
+}
+
+}
+
+Gym_SubprocVectorEnv::Gym_SubprocVectorEnv(const Factory &factory, int envs, int processes, int depth)
+{
+    if ( envs < 1 ) {
+        throw std::invalid_argument("Gym_SubprocVectorEnv needs at least one environment");
+    }
+    if ( processes < 1 ) {
+        processes = int(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    processes = std::min(processes, envs);
+    mEnvCount = envs;
+    mDepth = std::max(2, std::min(depth, 8));
+
+    mvBegin.resize(processes + 1);
+    for ( int p=0; p<=processes; ++p ) {
+        mvBegin[p] = int(int64_t(envs) * p / processes);
+    }
+
+    mChannelBytes = align64(sizeof(Channel) * processes);
+    void *channels = mmap(nullptr, mChannelBytes, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if ( MAP_FAILED == channels ) {
+        throw std::runtime_error("Gym_SubprocVectorEnv: mmap of the control block failed");
+    }
+    mChannels = static_cast<Channel*>(channels);
+    for ( int p=0; p<processes; ++p ) {
+        new (mChannels + p) Channel();
+    }
+
+    //Unlinked right away, the descriptor is inherited by the workers
+    static std::atomic<uint32_t> instance{0};
+    char name[64];
+    std::snprintf(name, sizeof(name), "/gym_subproc_%d_%u", int(getpid()), unsigned(instance++));
+    mShmFd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if ( mShmFd < 0 ) {
+        shutdown();
+        throw std::runtime_error("Gym_SubprocVectorEnv: shm_open failed");
+    }
+    shm_unlink(name);
+
+    const int threads = thread_count();
+    if ( 1 < threads ) {
+        std::cout << "Gym_SubprocVectorEnv: forking a process with " << threads << " threads, "
+                     "the env processes may hang on locks those threads held. Construct it "
+                     "before libtorch or the worker pools start threads." << std::endl;
+    }
+    for ( int p=0; p<processes; ++p ) {
+        const pid_t pid = fork();
+        if ( 0 == pid ) {
+            worker_main(p, factory);
+            _exit(0);
+        }
+        if ( pid < 0 ) {
+            shutdown();
+            throw std::runtime_error("Gym_SubprocVectorEnv: fork failed");
+        }
+        mvPid.push_back(int(pid));
+    }
+
+    //Command 0 is building the envs, the workers report their dimensions
+    try {
+        wait(0);
+    } catch (...) {
+        shutdown();
+        throw;
+    }
+    mActionDim = mChannels[0].actionDim;
+    mStateDim = mChannels[0].stateDim;
+    for ( int p=0; p<processes; ++p ) {
+        if ( mChannels[p].actionDim != mActionDim || mChannels[p].stateDim != mStateDim ) {
+            shutdown();
+            throw std::invalid_argument("Gym_SubprocVectorEnv needs environments of equal "
+                                        "state and action dimensions");
+        }
+    }
+
+    mSlotBytes = align64(sizeof(float) * envs * mActionDim) + align64(sizeof(float) * envs * mStateDim)
+               + align64(sizeof(float) * envs) + align64(sizeof(int32_t) * envs);
+    mDataBytes = mSlotBytes * mDepth;
+    if ( 0 != ftruncate(mShmFd, off_t(mDataBytes)) ) {
+        shutdown();
+        throw std::runtime_error("Gym_SubprocVectorEnv: ftruncate of the shared memory failed");
+    }
+    mData = mmap(nullptr, mDataBytes, PROT_READ | PROT_WRITE, MAP_SHARED, mShmFd, 0);
+    if ( MAP_FAILED == mData ) {
+        mData = nullptr;
+        shutdown();
+        throw std::runtime_error("Gym_SubprocVectorEnv: mmap of the shared memory failed");
+    }
+    map_slots(mData);
+
+    for ( int p=0; p<processes; ++p ) {
+        mChannels[p].dataBytes = mDataBytes;
+    }
+    mSequence = 1;
+    try {
+        wait(post(Command::Map));
+        //The workers forked one torch generator state and would all draw the
+        //same seeds, seed them from one draw here instead
+        auto words = torch::randint(0, int64_t(1) << 32, {2}, torch::TensorOptions().dtype(torch::kLong));
+        const int64_t *w = words.data_ptr<int64_t>();
+        seed((uint64_t(w[0]) << 32) | uint64_t(w[1]));
+    } catch (...) {
+        shutdown();
+        throw;
+    }
+}
+
+Gym_SubprocVectorEnv::~Gym_SubprocVectorEnv()
+{
+    shutdown();
+}
+
+void Gym_SubprocVectorEnv::map_slots(void *base)
+{
+    const int n = mEnvCount;
+    char *p = static_cast<char*>(base);
+    mvSlots.resize(mDepth);
+    for ( auto &slot : mvSlots ) {
+        slot.actions = reinterpret_cast<float*>(p);
+        p += align64(sizeof(float) * n * mActionDim);
+        slot.state = reinterpret_cast<float*>(p);
+        p += align64(sizeof(float) * n * mStateDim);
+        slot.reward = reinterpret_cast<float*>(p);
+        p += align64(sizeof(float) * n);
+        slot.done = reinterpret_cast<int32_t*>(p);
+        p += align64(sizeof(int32_t) * n);
+
+        slot.tActions = torch::from_blob(slot.actions, {n, mActionDim});
+        slot.tState = torch::from_blob(slot.state, {n, mStateDim});
+        slot.tReward = torch::from_blob(slot.reward, {n});
+        slot.tDone = torch::from_blob(slot.done, {n}, torch::TensorOptions().dtype(torch::kInt));
+    }
+}
+
+void Gym_SubprocVectorEnv::worker_main(int p, const Factory &factory)
+{
+    //A dead trainer takes its workers along
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    //Before any other torch call: the intra-op pool did not survive fork()
+    at::set_num_threads(1);
+
+    Channel &c = mChannels[p];
+    const int begin = mvBegin[p];
+    const int end = mvBegin[p + 1];
+
+    std::vector<std::unique_ptr<Gym_Torch>> envs;
+    try {
+        for ( int i=begin; i<end; ++i ) {
+            envs.push_back(factory(i));
+        }
+        c.actionDim = envs[0]->action_dimension();
+        c.stateDim = envs[0]->state_dimension();
+        c.envIds = 0;
+        for ( auto &e : envs ) {
+            //Each env owns one row of the slot, as in Gym_VectorEnv
+            if ( 1 != e->env_ids() ) {
+                throw std::invalid_argument("Gym_SubprocVectorEnv needs single environments, "
+                                            "not batches of " + std::to_string(e->env_ids()));
+            }
+            c.envIds += e->env_ids();
+            if ( e->action_dimension() != c.actionDim || e->state_dimension() != c.stateDim ) {
+                c.actionDim = c.stateDim = -1;
+            }
+        }
+    } catch (const std::exception &e) {
+        report_error(c.error, e.what());
+        c.failed = 1;
+    }
+    c.response.store(1, std::memory_order_release);
+    futex_wake(c.response);
+    if ( c.failed ) {
+        _exit(1);
+    }
+
+    //Row views of this worker's envs, per slot
+    struct Rows
+    {
+        std::vector<torch::Tensor> actions, state, reward, done;
+    };
+    std::vector<Rows> vRows;
+
+    for ( uint32_t seq=1;; ++seq ) {
+        uint32_t posted;
+        while ( !seq_after(posted = c.request.load(std::memory_order_acquire), seq) ) {
+            futex_wait(c.request, posted, -1);
+        }
+        const Command command = c.command[seq % kCommandRing];
+        if ( Command::Quit == command ) {
+            c.response.store(seq + 1, std::memory_order_release);
+            futex_wake(c.response);
+            return;
+        }
+
+        try {
+            const int s = int(seq % uint32_t(mDepth));
+            switch ( command ) {
+            case Command::Map: {
+                mActionDim = c.actionDim;
+                mStateDim = c.stateDim;
+                mDataBytes = c.dataBytes;
+                mData = mmap(nullptr, mDataBytes, PROT_READ | PROT_WRITE, MAP_SHARED, mShmFd, 0);
+                if ( MAP_FAILED == mData ) {
+                    throw std::runtime_error("mmap of the shared memory failed");
+                }
+                map_slots(mData);
+                vRows.resize(mDepth);
+                for ( int k=0; k<mDepth; ++k ) {
+                    for ( int i=begin; i<end; ++i ) {
+                        vRows[k].actions.push_back(mvSlots[k].tActions.select(0, i));
+                        vRows[k].state.push_back(mvSlots[k].tState.select(0, i));
+                        vRows[k].reward.push_back(mvSlots[k].tReward.narrow(0, i, 1));
+                        vRows[k].done.push_back(mvSlots[k].tDone.narrow(0, i, 1));
+                    }
+                }
+                break;
+            }
+            case Command::Reset:
+                for ( int i=0; i<end-begin; ++i ) {
+                    vRows[s].state[i].copy_(envs[i]->reset().view_as(vRows[s].state[i]));
+                }
+                break;
+            case Command::Step:
+                for ( int i=0; i<end-begin; ++i ) {
+                    envs[i]->step_into(vRows[s].actions[i], vRows[s].state[i],
+                                       vRows[s].reward[i], vRows[s].done[i]);
+                }
+                break;
+            case Command::Sample:
+                for ( int i=0; i<end-begin; ++i ) {
+                    vRows[s].actions[i].copy_(envs[i]->sample_action().view_as(vRows[s].actions[i]));
+                }
+                break;
+            case Command::Seed: {
+                uint32_t id = c.envId;
+                for ( auto &e : envs ) {
+                    e->seed(c.seed, id);
+                    id += e->env_ids();
+                }
+                break;
+            }
+            case Command::Quit:
+                break;
+            }
+        } catch (const std::exception &e) {
+            report_error(c.error, e.what());
+            c.failed = 1;
+        }
+        c.response.store(seq + 1, std::memory_order_release);
+        futex_wake(c.response);
+    }
+}
+
+Gym_SubprocVectorEnv::Slot& Gym_SubprocVectorEnv::free_slot()
+{
+    //The slot was last used by command mSequence - mDepth
+    if ( uint32_t(mDepth) <= mSequence ) {
+        wait(mSequence - mDepth);
+    }
+    return mvSlots[mSequence % uint32_t(mDepth)];
+}
+
+uint32_t Gym_SubprocVectorEnv::post(Command command)
+{
+    free_slot();
+    const uint32_t seq = mSequence++;
+    for ( int p=0; p<process_count(); ++p ) {
+        Channel &c = mChannels[p];
+        c.command[seq % kCommandRing] = command;
+        c.request.store(seq + 1, std::memory_order_release);
+        futex_wake(c.request);
+    }
+    return seq;
+}
+
+void Gym_SubprocVectorEnv::wait(uint32_t sequence)
+{
+    //Every process is waited for and its failure flag cleared before
+    //throwing, a failure must not resurface from a later call
+    std::string errors;
+    auto fail = [&errors](int p, const std::string &what) {
+        errors += (errors.empty() ? "Gym_SubprocVectorEnv: env process " : "; env process ") +
+                  std::to_string(p) + what;
+    };
+    for ( int p=0; p<process_count(); ++p ) {
+        Channel &c = mChannels[p];
+        uint32_t done;
+        while ( !seq_after(done = c.response.load(std::memory_order_acquire), sequence) ) {
+            if ( mvPid[p] < 0 ) {
+                fail(p, " is gone");
+                break;
+            }
+            //Timed out or woken: see whether the worker is still there
+            if ( !futex_wait(c.response, done, 50) ) {
+                int status = 0;
+                if ( mvPid[p] == waitpid(mvPid[p], &status, WNOHANG) ) {
+                    mvPid[p] = -1;
+                    const std::string how = WIFSIGNALED(status) ?
+                                " was killed by signal " + std::to_string(WTERMSIG(status)) :
+                                " exited with status " + std::to_string(WEXITSTATUS(status));
+                    fail(p, how + (c.failed ? std::string(": ") + c.error : ""));
+                    c.failed = 0;
+                    break;
+                }
+            }
+        }
+        if ( c.failed ) {
+            c.failed = 0;
+            fail(p, std::string(": ") + c.error);
+        }
+    }
+    if ( !errors.empty() ) {
+        throw std::runtime_error(errors);
+    }
+}
+
+void Gym_SubprocVectorEnv::check_idle(const char *call) const
+{
+    if ( !mvPendingSteps.empty() ) {
+        throw std::logic_error(std::string("Gym_SubprocVectorEnv::") + call +
+                               " called with steps outstanding, step_wait() first");
+    }
+}
+
+void Gym_SubprocVectorEnv::shutdown()
+{
+    if ( mChannels ) {
+        //Command 0 (building the envs) is not posted, the workers wait for
+        //command 1 at the earliest
+        const uint32_t quit = std::max(mSequence, 1u);
+        for ( size_t p=0; p<mvPid.size(); ++p ) {
+            if ( 0 < mvPid[p] ) {
+                Channel &c = mChannels[p];
+                c.command[quit % kCommandRing] = Command::Quit;
+                c.request.store(quit + 1, std::memory_order_release);
+                futex_wake(c.request);
+            }
+        }
+        for ( size_t p=0; p<mvPid.size(); ++p ) {
+            if ( mvPid[p] <= 0 ) {
+                continue;
+            }
+            int status;
+            int waited = 0;
+            while ( 0 == waitpid(mvPid[p], &status, WNOHANG) && waited < 2000 ) {
+                usleep(1000);
+                ++waited;
+            }
+            if ( 2000 <= waited ) {
+                kill(mvPid[p], SIGKILL);
+                waitpid(mvPid[p], &status, 0);
+            }
+            mvPid[p] = -1;
+        }
+    }
+    mvSlots.clear();
+    if ( mData ) {
+        munmap(mData, mDataBytes);
+        mData = nullptr;
+    }
+    if ( 0 <= mShmFd ) {
+        close(mShmFd);
+        mShmFd = -1;
+    }
+    if ( mChannels ) {
+        munmap(mChannels, mChannelBytes);
+        mChannels = nullptr;
+    }
+}
+
+at::Tensor Gym_SubprocVectorEnv::reset()
+{
+    check_idle("reset()");
+    const uint32_t seq = post(Command::Reset);
+    wait(seq);
+    return mvSlots[seq % uint32_t(mDepth)].tState;
+}
+
+Gym_Torch::dType Gym_SubprocVectorEnv::step(at::Tensor action)
+{
+    check_idle("step()");
+    step_async(action);
+    return step_wait();
+}
+
+void Gym_SubprocVectorEnv::step_async(at::Tensor action)
+{
+    //One slot stays with the result the caller got last
+    if ( int(mvPendingSteps.size()) >= mDepth - 1 ) {
+        throw std::logic_error("Gym_SubprocVectorEnv::step_async(): depth - 1 steps are "
+                               "outstanding, step_wait() first");
+    }
+    Slot &slot = free_slot();
+    slot.tActions.copy_(action.view_as(slot.tActions));
+    mvPendingSteps.push_back(post(Command::Step));
+}
+
+Gym_Torch::dType Gym_SubprocVectorEnv::step_wait()
+{
+    if ( mvPendingSteps.empty() ) {
+        throw std::logic_error("Gym_SubprocVectorEnv::step_wait() without step_async()");
+    }
+    const uint32_t seq = mvPendingSteps.front();
+    mvPendingSteps.pop_front();
+    wait(seq);
+    const Slot &slot = mvSlots[seq % uint32_t(mDepth)];
+    return std::make_tuple<>(slot.tState, slot.tReward, slot.tDone, torch::Tensor());
+}
+
+at::Tensor Gym_SubprocVectorEnv::sample_action()
+{
+    check_idle("sample_action()");
+    const uint32_t seq = post(Command::Sample);
+    wait(seq);
+    return mvSlots[seq % uint32_t(mDepth)].tActions.clone();
+}
+
+void Gym_SubprocVectorEnv::seed(uint64_t seed, uint32_t envId)
+{
+    check_idle("seed()");
+    for ( int p=0; p<process_count(); ++p ) {
+        mChannels[p].seed = seed;
+        mChannels[p].envId = envId;
+        envId += mChannels[p].envIds;
+    }
+    wait(post(Command::Seed));
+}
+
+uint32_t Gym_SubprocVectorEnv::env_ids() const
+{
+    uint32_t ids = 0;
+    for ( int p=0; p<process_count(); ++p ) {
+        ids += mChannels[p].envIds;
+    }
+    return ids;
+}
+
+#else
+
+Gym_SubprocVectorEnv::Gym_SubprocVectorEnv(const Factory&, int, int, int)
+{
+    throw std::runtime_error("Gym_SubprocVectorEnv is only available on Linux");
+}
+
+Gym_SubprocVectorEnv::~Gym_SubprocVectorEnv()
+{
+
+}
+
+at::Tensor Gym_SubprocVectorEnv::reset()
+{
+    return torch::Tensor();
+}
+
+Gym_Torch::dType Gym_SubprocVectorEnv::step(at::Tensor)
+{
+    return dType();
+}
+
+void Gym_SubprocVectorEnv::step_async(at::Tensor)
+{
+
+}
+
+Gym_Torch::dType Gym_SubprocVectorEnv::step_wait()
+{
+    return dType();
+}
+
+at::Tensor Gym_SubprocVectorEnv::sample_action()
+{
+    return torch::Tensor();
+}
+
+void Gym_SubprocVectorEnv::seed(uint64_t, uint32_t)
+{
+
+}
+
+uint32_t Gym_SubprocVectorEnv::env_ids() const
+{
+    return 0;
+}
+
+#endif
+
+int Gym_SubprocVectorEnv::action_dimension()
+{
+    return mActionDim;
+}
+
+int Gym_SubprocVectorEnv::state_dimension()
+{
+    return mStateDim;
+}
+
+int Gym_SubprocVectorEnv::env_count() const
+{
+    return mEnvCount;
+}
+
+int Gym_SubprocVectorEnv::process_count() const
+{
+    return int(mvBegin.size()) - 1;
+}
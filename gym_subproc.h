@@ -0,0 +1,136 @@
+#ifndef GYM_SUBPROC_H
+#define GYM_SUBPROC_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "gym_torch.h"
+
+/**
+ * N environments hosted by worker processes. Process p builds envs
+ * [begin_p, end_p) with the factory and runs them single threaded, so they
+ * neither compete with the trainer's intra-op threads nor take the trainer
+ * down when they crash: a dead worker shows up as a std::runtime_error from
+ * the call waiting for it. The envs must be single envs (env_ids() == 1),
+ * each owns one row of the shared slots.
+ *
+ * Actions, states, rewards and dones live in POSIX shared memory as a ring
+ * of `depth` slots of stacked [N, ...] arrays. Every command (step, reset,
+ * ...) goes to all processes with the next sequence number, uses slot
+ * sequence % depth, and is signalled with futexes on two counters per
+ * process, so observations are written once, by the env, and read in place
+ * by the trainer. Tensors returned by step()/step_wait()/reset() are views
+ * of their slot and are overwritten `depth` commands later.
+ *
+ * States are float and depth is at most 8. Only available on Linux (fork,
+ * futex); elsewhere the constructor throws.
+ *
+ * The workers are fork()ed without exec, so they inherit the locks of the
+ * trainer's threads but not the threads. Construct the env before anything
+ * starts threads: libtorch's intra-op pool (the first parallel op),
+ * Gym_WorkerPool/Gym_VectorEnv, the renderer. Otherwise a worker can hang
+ * on a lock a vanished thread held; the constructor warns when the process
+ * already runs more than one thread.
+ */
+class Gym_SubprocVectorEnv : public Gym_Torch
+{
+public:
+    using Factory = std::function<std::unique_ptr<Gym_Torch>(int envIndex)>;
+
+    /** processes = 0 uses one process per hardware thread */
+    Gym_SubprocVectorEnv(const Factory &factory, int envs, int processes = 0, int depth = 2);
+    virtual ~Gym_SubprocVectorEnv();
+
+    Gym_SubprocVectorEnv(const Gym_SubprocVectorEnv&) = delete;
+    Gym_SubprocVectorEnv& operator=(const Gym_SubprocVectorEnv&) = delete;
+
+    // Gym_Torch interface
+    virtual torch::Tensor reset() override;
+    virtual dType step(torch::Tensor action) override;
+    virtual torch::Tensor sample_action() override;
+    virtual int action_dimension() override;
+    virtual int state_dimension() override;
+    //Env i is seeded as env id envId + env_ids() of envs 0 .. i-1
+    virtual void seed(uint64_t seed, uint32_t envId = 0) override;
+    virtual uint32_t env_ids() const override;
+
+    /** Queue a step of all envs, at most depth - 1 may be outstanding */
+    void step_async(torch::Tensor action);
+    /** Result of the oldest outstanding step_async() */
+    dType step_wait();
+
+    int env_count() const;
+    int process_count() const;
+
+protected:
+    enum class Command : uint32_t
+    {
+        Map,
+        Reset,
+        Step,
+        Sample,
+        Seed,
+        Quit
+    };
+
+    //Per process, in the control mapping shared by all processes
+    struct alignas(64) Channel
+    {
+        std::atomic<uint32_t> request;     //commands posted by the trainer
+        alignas(64) std::atomic<uint32_t> response;    //commands done by the worker
+        alignas(64) Command command[16];   //ring of commands, index sequence % 16
+        uint64_t dataBytes;
+        uint64_t seed;
+        uint32_t envId;         //first env id of the process
+        uint32_t envIds;        //env ids of the process's envs
+        int32_t actionDim;
+        int32_t stateDim;
+        int32_t failed;
+        char error[256];
+    };
+
+    struct Slot
+    {
+        float *actions;
+        float *state;
+        float *reward;
+        int32_t *done;
+        torch::Tensor tActions;
+        torch::Tensor tState;
+        torch::Tensor tReward;
+        torch::Tensor tDone;
+    };
+
+    Slot& free_slot();
+    uint32_t post(Command command);
+    //Waits for every process, then throws the failures of all of them at once
+    void wait(uint32_t sequence);
+    void check_idle(const char *call) const;
+    void map_slots(void *base);
+    void worker_main(int p, const Factory &factory);
+    void shutdown();
+
+    int mEnvCount = 0;
+    int mDepth = 2;
+    int mActionDim = 0;
+    int mStateDim = 0;
+    std::vector<int> mvBegin;  //env range of process p is [mvBegin[p], mvBegin[p+1])
+    std::vector<int> mvPid;
+
+    Channel *mChannels = nullptr;
+    size_t mChannelBytes = 0;
+    int mShmFd = -1;
+    void *mData = nullptr;
+    size_t mDataBytes = 0;
+    size_t mSlotBytes = 0;
+    std::vector<Slot> mvSlots;
+
+    uint32_t mSequence = 0;     //commands posted so far
+    std::deque<uint32_t> mvPendingSteps;
+};
+
+#endif // GYM_SUBPROC_H
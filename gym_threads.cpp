@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <exception>
+#include <iostream>
+#include <thread>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#include <torch/torch.h>
+
+#include "gym_threads.h"
+
+namespace {
+
+//CPUs the process may run on, in ascending order
+std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if ( 0 == sched_getaffinity(0, sizeof(set), &set) ) {
+        for ( int c=0; c<CPU_SETSIZE; ++c ) {
+            if ( CPU_ISSET(c, &set) ) {
+                cpus.push_back(c);
+            }
+        }
+    }
+#endif
+    if ( cpus.empty() ) {
+        const int n = int(std::max(1u, std::thread::hardware_concurrency()));
+        for ( int c=0; c<n; ++c ) {
+            cpus.push_back(c);
+        }
+    }
+    return cpus;
+}
+
+}
+
+Gym_ThreadBudget::Gym_ThreadBudget(int cores)
+    :mvCpus(allowed_cpus())
+{
+    mCores = 0 < cores ? cores : int(mvCpus.size());
+}
+
+int Gym_ThreadBudget::core_count() const
+{
+    return mCores;
+}
+
+Gym_ThreadSplit Gym_ThreadBudget::split(int envWorkers, bool renderer) const
+{
+    Gym_ThreadSplit s;
+    s.renderThreads = renderer && 2 < mCores ? 1 : 0;
+    const int left = mCores - s.renderThreads;
+    s.envWorkers = std::max(1, std::min(envWorkers, left - 1));
+    s.intraOpThreads = std::max(1, left - s.envWorkers);
+    s.interOpThreads = 1;
+    return s;
+}
+
+Gym_ThreadSplit Gym_ThreadBudget::default_split(bool renderer) const
+{
+    return split(std::max(1, mCores / 2), renderer);
+}
+
+std::vector<Gym_ThreadSplit> Gym_ThreadBudget::candidate_splits(bool renderer) const
+{
+    std::vector<Gym_ThreadSplit> v;
+    const int most = split(mCores, renderer).envWorkers;
+    for ( int e=1; e<most; e*=2 ) {
+        v.push_back(split(e, renderer));
+    }
+    v.push_back(split(most, renderer));
+    return v;
+}
+
+std::vector<int> Gym_ThreadBudget::env_cores(const Gym_ThreadSplit &split) const
+{
+    std::vector<int> cores(split.envWorkers);
+    for ( int w=0; w<split.envWorkers; ++w ) {
+        cores[w] = mvCpus[size_t(w % mCores) % mvCpus.size()];
+    }
+    return cores;
+}
+
+int Gym_ThreadBudget::render_core(const Gym_ThreadSplit &split) const
+{
+    return 0 < split.renderThreads ? mvCpus[size_t(split.envWorkers % mCores) % mvCpus.size()] : -1;
+}
+
+bool Gym_ThreadBudget::pin_renderer(const Gym_ThreadSplit &split) const
+{
+    const int core = render_core(split);
+    return 0 <= core && pin_current_thread(core);
+}
+
+bool Gym_ThreadBudget::pin_current_thread(int core)
+{
+#if defined(__linux__)
+    if ( CPU_SETSIZE <= core ) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    return 0 == pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(_WIN32)
+    return core < 64 && 0 != SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << core);
+#else
+    (void)core;
+    return false;
+#endif
+}
+
+void Gym_ThreadBudget::apply(const Gym_ThreadSplit &split)
+{
+    torch::set_num_threads(split.intraOpThreads);
+    if ( torch::get_num_interop_threads() != split.interOpThreads ) {
+        try {
+            torch::set_num_interop_threads(split.interOpThreads);
+        } catch (const std::exception &e) {
+            std::cout << "Gym_ThreadBudget: inter-op threads stay at " << torch::get_num_interop_threads()
+                      << " (" << e.what() << ")" << std::endl;
+        }
+    }
+}
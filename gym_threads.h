@@ -0,0 +1,64 @@
+#ifndef GYM_THREADS_H
+#define GYM_THREADS_H
+
+#include <vector>
+
+/** How the cores of one machine are shared out */
+struct Gym_ThreadSplit
+{
+    int envWorkers = 1;         //Gym_VectorEnv / Gym_WorkerPool workers
+    int renderThreads = 0;      //0 or 1, the GL renderer
+    int intraOpThreads = 1;     //torch::set_num_threads()
+    int interOpThreads = 1;     //torch::set_num_interop_threads()
+};
+
+/**
+ * Splits a core budget between env workers, the renderer and libtorch, so
+ * that together they use every core once instead of each sizing itself to
+ * the whole machine. Env workers get budget cores [0, envWorkers), the
+ * renderer the next one and libtorch the rest; libtorch's pools cannot be
+ * pinned from here, only sized. Inter-op work (async forks) is rare in the
+ * training loop, so its single thread is not counted against the budget.
+ * Budget core i is the i-th CPU the process may run on (its affinity mask
+ * on Linux, CPU i elsewhere), so the core maps stay valid inside a cpuset.
+ */
+class Gym_ThreadBudget
+{
+public:
+    /** cores = 0 uses the hardware thread count */
+    explicit Gym_ThreadBudget(int cores = 0);
+
+    int core_count() const;
+
+    /** envWorkers for the envs (clamped to leave libtorch one core), the rest to libtorch */
+    Gym_ThreadSplit split(int envWorkers, bool renderer = false) const;
+    /** Half the cores to the envs, the rest to libtorch */
+    Gym_ThreadSplit default_split(bool renderer = false) const;
+    /** split(e, renderer) for e = 1, 2, 4, ... and the largest e, for sweeps */
+    std::vector<Gym_ThreadSplit> candidate_splits(bool renderer = false) const;
+
+    /** Core map for Gym_VectorEnv / Gym_WorkerPool */
+    std::vector<int> env_cores(const Gym_ThreadSplit &split) const;
+    /** Core of the renderer thread, -1 without one */
+    int render_core(const Gym_ThreadSplit &split) const;
+    /**
+     * Pins the calling thread, the one that will own the GL context, to
+     * render_core(split). false without a renderer core or when pinning fails
+     */
+    bool pin_renderer(const Gym_ThreadSplit &split) const;
+
+    /** Pins the calling thread to CPU core, false when that is not possible */
+    static bool pin_current_thread(int core);
+
+    /**
+     * Sizes libtorch's pools. The inter-op pool can only be sized before its
+     * first use; a later change is reported and skipped.
+     */
+    static void apply(const Gym_ThreadSplit &split);
+
+private:
+    int mCores;
+    std::vector<int> mvCpus;    //CPU of each budget core, the process's affinity mask
+};
+
+#endif // GYM_THREADS_H
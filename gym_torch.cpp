@@ -1,14 +1,179 @@
+#include <cstring>
+#include <type_traits>
+
 #include "gym_torch.h"
 
+namespace {
+
+/** Key for envs that are never seed()ed, drawn from the torch generator */
+uint64_t torch_seed()
+{
+    auto words = torch::randint(0, int64_t(1) << 32, {2}, torch::TensorOptions().dtype(torch::kLong));
+    const int64_t *w = words.data_ptr<int64_t>();
+    return (uint64_t(w[0]) << 32) | uint64_t(w[1]);
+}
+
+/** Initial state values 2*pair and 2*pair+1 of an episode, U(-0.05, 0.05) */
+inline void initial_pair(uint64_t seed, uint32_t envId, uint32_t episode, uint32_t pair, double v[2])
+{
+    gym_rng_uniform2(seed, {envId, episode, 0, gym_rng_block(Gym_Rng_Stream::Reset, pair)}, v);
+    v[0] = 0.1 * v[0] - 0.05;
+    v[1] = 0.1 * v[1] - 0.05;
+}
+
+/** N(0, 0.5) actions 2*pair and 2*pair+1 of a step */
+inline void action_pair(uint64_t seed, uint32_t envId, uint32_t episode, uint32_t step, uint32_t pair, double v[2])
+{
+    gym_rng_normal2(seed, {envId, episode, step, gym_rng_block(Gym_Rng_Stream::Action, pair)}, v);
+    v[0] *= 0.5;
+    v[1] *= 0.5;
+}
+
+/**
+ * Calls f with a pointer to the action data. Contiguous float and double
+ * actions are read in place, anything else is converted to double first.
+ */
+template<class F>
+void with_action(const torch::Tensor &action, F &&f)
+{
+    if ( action.is_contiguous() ) {
+        if ( action.scalar_type() == torch::kDouble ) {
+            f(action.data_ptr<double>());
+            return;
+        }
+        if ( action.scalar_type() == torch::kFloat ) {
+            f(action.data_ptr<float>());
+            return;
+        }
+    }
+    auto act = action.to(torch::kDouble).contiguous();
+    f(act.data_ptr<double>());
+}
+
+template<typename S, typename D>
+void convert_state(const S *src, D *dst, int64_t n)
+{
+    for ( int64_t i=0; i<n; ++i ) {
+        dst[i] = D(src[i]);
+    }
+}
+
+template<typename S>
+void copy_state(const S *src, const torch::Tensor &out, int64_t n)
+{
+    if ( out.scalar_type() == torch::kDouble ) {
+        convert_state(src, out.data_ptr<double>(), n);
+    } else {
+        convert_state(src, out.data_ptr<float>(), n);
+    }
+}
+
+/** out = state, in place for contiguous float or double outputs */
+void copy_state(const torch::Tensor &state, torch::Tensor out)
+{
+    const bool direct = out.is_contiguous() && out.numel() == state.numel() &&
+            (out.scalar_type() == torch::kDouble || out.scalar_type() == torch::kFloat);
+    if ( !direct ) {
+        out.copy_(state.view_as(out));
+    } else if ( out.data_ptr() == state.data_ptr() ) {
+        return;
+    } else if ( state.scalar_type() == torch::kDouble ) {
+        copy_state(state.data_ptr<double>(), out, state.numel());
+    } else {
+        copy_state(state.data_ptr<float>(), out, state.numel());
+    }
+}
+
+/** The first two of every `stride` channels of pixels src into pairs at dst */
+template<typename S, typename D>
+void copy_channels(const S *src, int stride, D *dst, int64_t pixels)
+{
+    for ( int64_t p=0; p<pixels; ++p ) {
+        dst[2*p] = D(src[p*stride]);
+        dst[2*p + 1] = D(src[p*stride + 1]);
+    }
+}
+
+/**
+ * Ring of `frames` [pixels, 2] slots, newest at head, into [pixels, frames, 2]
+ * with the oldest frame first
+ */
+template<typename T>
+void stack_history(const T *ring, int frames, int head, int64_t pixels, T *out)
+{
+    for ( int f=0; f<frames; ++f ) {
+        const T *slot = ring + ((head + 1 + f) % frames) * pixels * 2;
+        for ( int64_t p=0; p<pixels; ++p ) {
+            out[(p*frames + f)*2] = slot[2*p];
+            out[(p*frames + f)*2 + 1] = slot[2*p + 1];
+        }
+    }
+}
+
+/** take ? with : keep, as a bit mask so that the compiler keeps it branch free */
+template<typename T>
+inline T lane_blend(uint8_t take, T keep, T with)
+{
+    using U = typename std::conditional<sizeof(T) == 8, uint64_t, uint32_t>::type;
+    U a, b;
+    std::memcpy(&a, &keep, sizeof(T));
+    std::memcpy(&b, &with, sizeof(T));
+    const U m = U(0) - U(take != 0);
+    a = (a & ~m) | (b & m);
+    std::memcpy(&keep, &a, sizeof(T));
+    return keep;
+}
+
+}
+
+CartPole::CartPole(Kinematics_Integrator integrator)
+    :CartPole_Physics(integrator)
+    ,mSeed(torch_seed())
+{
+    bind_state(4);
+}
+
 CartPole::~CartPole()
 {
 
 }
 
+void CartPole::bind_state(int dim)
+{
+    mvPhysState.assign(dim, 0.0);
+    mState = torch::zeros({dim,});
+}
+
+void CartPole::publish_state()
+{
+    float *state = mState.data_ptr<float>();
+    for ( size_t i=0; i<mvPhysState.size(); ++i ) {
+        state[i] = float(mvPhysState[i]);
+    }
+}
+
+void CartPole::seed(uint64_t seed, uint32_t envId)
+{
+    mSeed = seed;
+    mEnvId = envId;
+    mEpisode = uint32_t(-1);
+    mStep = 0;
+}
+
+void CartPole::draw_initial_state()
+{
+    ++mEpisode;
+    mStep = 0;
+    double *s = mvPhysState.data();
+    for ( size_t i=0; i<mvPhysState.size(); i+=2 ) {
+        initial_pair(mSeed, mEnvId, mEpisode, uint32_t(i/2), s + i);
+    }
+    publish_state();
+}
+
 at::Tensor CartPole::reset()
 {
-   auto tmp = torch::zeros({4,});
-   mState = tmp.uniform_(-0.05,0.05);
+   draw_initial_state();
    //state[0] = state[1] = state[2] = state[3] = 0.02;
 
    steps_beyond_done = -1;
@@ -17,55 +182,55 @@ at::Tensor CartPole::reset()
 
 Gym_Torch::dType CartPole::step(at::Tensor action)
 {
-    double x = mState[0].item().toDouble();
-    double x_dot = mState[1].item().toDouble();
-    double theta = mState[2].item().toDouble();
-    double theta_dot = mState[3].item().toDouble();
+    auto reward = torch::zeros({1});
+    auto tmp = torch::Tensor();
+    auto done = torch::zeros({1}, torch::TensorOptions().dtype(torch::kInt));
+    advance(action, *reward.data_ptr<float>(), *done.data_ptr<int>());
+    return std::make_tuple<>(mState, reward, done, tmp);
+}
+
+void CartPole::step_into(at::Tensor action, at::Tensor out_state, at::Tensor out_reward,
+                         at::Tensor out_done)
+{
+    advance(action, *out_reward.data_ptr<float>(), *out_done.data_ptr<int>());
+    copy_state(mState, out_state);
+}
+
+void CartPole::advance(const at::Tensor &action, float &reward, int &done)
+{
+    double *s = mvPhysState.data();
 
 //    std::cout << action << " - " << action.item().toInt() << std::endl;
 
     auto force = action.item().toInt() == 1 ? force_mag : -force_mag;
-    auto costheta = std::cos(theta);
-    auto sintheta = std::sin(theta);
-
-    /** For the interested reader:
-    * https://coneural.org/florian/papers/05_cart_pole.pdf
-    * **/
-    auto temp = (force + polemass_length * theta_dot * theta_dot * sintheta ) / total_mass;
-    auto thetaAcc = (gravity * sintheta - costheta * temp) /
-            (length * (4.0 / 3.0 - masspole * costheta * costheta / total_mass));
-    auto xacc = temp - polemass_length * thetaAcc * costheta / total_mass;
-
-    if ( kinematics_integrator == "euler") {
-        x = x + tau * x_dot;
-        x_dot = x_dot + tau * xacc;
-        theta = theta + tau * theta_dot;
-        theta_dot = theta_dot + tau * thetaAcc;
-    } else {  // semi-implicit euler
-        x_dot = x_dot + tau * xacc;
-        x = x + tau * x_dot;
-        theta_dot = theta_dot + tau * thetaAcc;
-        theta = theta + tau * theta_dot;
-    }
-
-    mState[0] = x;
-    mState[1] = x_dot;
-    mState[2] = theta;
-    mState[3] = theta_dot;
-
-    auto _done = (x < -x_threshold) || (x > x_threshold) ||
-            (theta < -theta_threshold_radians) || (theta > theta_threshold_radians);
+    bool _done = false;
+    int executed = 0;
+    while ( executed < substeps && !_done ) {
+        step_axis(s, force);
+        ++executed;
+
+        const double x = s[0];
+        const double theta = s[2];
+        _done = (x < -x_threshold) || (x > x_threshold) ||
+                (theta < -theta_threshold_radians) || (theta > theta_threshold_radians);
+    }
+    const double alive = double(executed) / substeps;
+    ++mStep;
 
-    auto reward = torch::zeros({1});
-    auto tmp = torch::Tensor();
-    auto done = torch::zeros({1}, torch::TensorOptions().dtype(torch::kInt));
-    done[0] = _done ? 1 : 0;
+    finish_step(_done, alive, reward, done);
+}
+
+void CartPole::finish_step(bool _done, double alive, float &reward, int &done)
+{
+    publish_state();
+    done = _done ? 1 : 0;
+    reward = 0.0f;
 
     if (!_done) {
-        reward[0] = 1.0;
+        reward = float(alive);
     } else if ( 0 > steps_beyond_done ) {//Pole just fell!
         steps_beyond_done = 0;
-        reward[0] = 1.0;
+        reward = float(alive);
     } else {
         if (steps_beyond_done == 0){
             std::cout <<
@@ -75,15 +240,15 @@ Gym_Torch::dType CartPole::step(at::Tensor action)
                 "True' -- any further steps are undefined behavior."
             << std::endl;
             steps_beyond_done += 1;
-            reward[0] = 0.0;
         }
     }
-    return std::make_tuple<>(mState, reward, done, tmp);
- }
+}
 
 at::Tensor CartPole::sample_action()
 {
-    return torch::randint(0,2,{1});
+    uint32_t w[4];
+    gym_philox4x32(mSeed, {mEnvId, mEpisode, mStep, gym_rng_block(Gym_Rng_Stream::Action, 0)}, w);
+    return torch::full({1}, int64_t(w[0] & 1u), torch::TensorOptions().dtype(torch::kLong));
 }
 
 int CartPole::action_dimension()
@@ -96,10 +261,44 @@ int CartPole::state_dimension()
     return 4;
 }
 
-CartPole_Continous::CartPole_Continous(bool b2D)
-    :m_b2D(b2D)
+void CartPole::set_substeps(int k)
 {
+    if ( 1 > k ) {
+        std::cout << "At least one substep per step is needed, got " << k
+                  << ". One substep will be used." << std::endl;
+        k = 1;
+    }
+    substeps = k;
+}
 
+int CartPole::substep_count() const
+{
+    return substeps;
+}
+
+CartPole_Continous::CartPole_Continous(bool b2D, Kinematics_Integrator integrator)
+    :CartPole_Continous(b2D ? 2 : 1, integrator)
+{
+}
+
+CartPole_Continous::CartPole_Continous(int axes, Kinematics_Integrator integrator)
+    :CartPole(integrator)
+    ,mAxes(axes)
+{
+    if ( 1 > mAxes ) {
+        std::cout << "CartPole_Continous needs at least one axis, got " << axes
+                  << ". One axis will be used." << std::endl;
+        mAxes = 1;
+    }
+    bind_state(CartPole_Continous::state_dimension());
+
+    //Below one AVX2 vector of axes stepping the padding lanes costs more
+    //than the scalar kernel saves
+    const Gym_ISA isa = 4 > mAxes ? Gym_ISA::Scalar : gym_best_isa();
+    mStride = Gym_ISA::Scalar == isa ? mAxes : gym_pad_lanes(mAxes);
+    mKernel = cartpole_kernel<double>(isa, kinematics_integrator);
+    mvLanes.assign(size_t(mStride) * 5, 0.0);
+    mvDone.assign(mStride, 0);
 }
 
 CartPole_Continous::~CartPole_Continous()
@@ -109,109 +308,92 @@ CartPole_Continous::~CartPole_Continous()
 
 at::Tensor CartPole_Continous::reset()
 {
-    auto tmp = torch::zeros({ state_dimension(),});
-    mState = tmp.uniform_(-0.05,0.05);
+    draw_initial_state();
     //state[0] = state[1] = state[2] = state[3] = 0.02;
 
     steps_beyond_done = -1;
     return mState;
 }
 
-Gym_Torch::dType CartPole_Continous::step(at::Tensor action)
+void CartPole_Continous::advance(const at::Tensor &action, float &reward, int &done)
 {
     const int stateDim = state_dimension();
-    auto reward = torch::zeros({1});
-    auto tmp = torch::Tensor();
-    auto done = torch::zeros({1}, torch::TensorOptions().dtype(torch::kInt));
     bool _done = false;
-
-    for( int i=0; i<stateDim; i+=4 ) {
-        double x = mState[i].item().toDouble();
-        double x_dot = mState[i+1].item().toDouble();
-        double theta = mState[i+2].item().toDouble();
-        double theta_dot = mState[i+3].item().toDouble();
-        double x_tip = 0.0;
-
-    //    std::cout << action << " - " << action.item().toInt() << std::endl;
-
-        auto force = action[i/4].item().toDouble() * force_mag;
-        auto costheta = std::cos(theta);
-        auto sintheta = std::sin(theta);
-
-        /** For the interested reader:
-        * https://coneural.org/florian/papers/05_cart_pole.pdf
-        * **/
-        auto temp = (force + polemass_length * theta_dot * theta_dot * sintheta ) / total_mass;
-        auto thetaAcc = (gravity * sintheta - costheta * temp) /
-                (length * (4.0 / 3.0 - masspole * costheta * costheta / total_mass));
-        auto xacc = temp - polemass_length * thetaAcc * costheta / total_mass;
-
-        if ( kinematics_integrator == "euler") {
-            x = x + tau * x_dot;
-            x_dot = x_dot + tau * xacc;
-            theta = theta + tau * theta_dot;
-            theta_dot = theta_dot + tau * thetaAcc;
-            x_tip = 2*length * std::sin(theta) + x;
-        } else {  // semi-implicit euler
-            x_dot = x_dot + tau * xacc;
-            x = x + tau * x_dot;
-            theta_dot = theta_dot + tau * thetaAcc;
-            theta = theta + tau * theta_dot;
-            x_tip = 2*length * std::sin(theta) + x;
+    double *s = mvPhysState.data();
+
+    double *x = mvLanes.data();
+    double *x_dot = x + mStride;
+    double *theta = x_dot + mStride;
+    double *theta_dot = theta + mStride;
+    double *force = theta_dot + mStride;
+    with_action(action, [&](const auto *pAct) {
+        for( int a=0, i=0; i<stateDim; ++a, i+=4 ) {
+            x[a] = s[i];
+            x_dot[a] = s[i+1];
+            theta[a] = s[i+2];
+            theta_dot[a] = s[i+3];
+            force[a] = pAct[a] * force_mag;
         }
-
-        mState[i] = x;
-        mState[i+1] = x_dot;
-        mState[i+2] = theta;
-        mState[i+3] = theta_dot;
-
-        _done |= (x < -x_threshold) || (x > x_threshold) ||
-            (theta < -theta_threshold_radians) || (theta > theta_threshold_radians)
-                || (x_tip < -x_threshold) || (x_tip > x_threshold);
-    }
-
-    done[0] = _done ? 1 : 0;
-    if (!_done) {
-        reward[0] = 1.0;
-    } else if ( 0 > steps_beyond_done ) {//Pole just fell!
-        steps_beyond_done = 0;
-        reward[0] = 1.0;
-    } else {
-        if (steps_beyond_done == 0){
-            std::cout <<
-                "You are calling 'step()' even though this "
-                "environment has already returned done = True. You "
-                "should always call 'reset()' once you receive 'done = "
-                "True' -- any further steps are undefined behavior."
-            << std::endl;
-            steps_beyond_done += 1;
-            reward[0] = 0.0;
+    });
+
+    std::fill(mvDone.begin(), mvDone.end(), 0);
+    const CartPole_Lanes<double> lanes{x, x_dot, theta, theta_dot, force, mvDone.data(), mStride};
+    int executed = 0;
+    while ( executed < substeps && !_done ) {
+        mKernel(*this, lanes);
+        ++executed;
+        for( int a=0; a<mAxes; ++a ) {
+            _done |= 0 != mvDone[a];
         }
     }
+    const double alive = double(executed) / substeps;
+    ++mStep;
+
+    for( int a=0, i=0; i<stateDim; ++a, i+=4 ) {
+        s[i] = x[a];
+        s[i+1] = x_dot[a];
+        s[i+2] = theta[a];
+        s[i+3] = theta_dot[a];
+    }
 
-    return std::make_tuple<>(mState, reward, done, tmp);
+    finish_step(_done, alive, reward, done);
 }
 
 at::Tensor CartPole_Continous::sample_action()
 {
-    if ( m_b2D ) {
-        return torch::normal(0.0, 0.5, {2});
+    auto action = torch::empty({mAxes});
+    float *pAct = action.data_ptr<float>();
+    for ( int a=0; a<mAxes; a+=2 ) {
+        double v[2];
+        action_pair(mSeed, mEnvId, mEpisode, mStep, uint32_t(a/2), v);
+        pAct[a] = float(v[0]);
+        if ( a + 1 < mAxes ) {
+            pAct[a+1] = float(v[1]);
+        }
     }
-    return torch::normal(0.0, 0.5, {1});
+    return action;
 }
 
 int CartPole_Continous::action_dimension()
 {
-    return m_b2D ? 2 : 1;
+    return mAxes;
 }
 
 int CartPole_Continous::state_dimension()
 {
-    return m_b2D ? 8 : 4;
+    return 4 * mAxes;
+}
+
+int CartPole_Continous::axis_count() const
+{
+    return mAxes;
 }
 
-CartPole_ContinousVision::CartPole_ContinousVision(bool b2D, int preFramesCount)
-    :CartPole_Continous(b2D)
+CartPole_ContinousVision::CartPole_ContinousVision(bool b2D, int preFramesCount,
+                                                   Kinematics_Integrator integrator)
+    :CartPole_Continous(b2D, integrator)
+    ,mvPos(mAxes)
+    ,mvAng(mAxes)
     ,mPreFramesCount(preFramesCount)
 {
     mRenderCB = nullptr;
@@ -224,224 +406,578 @@ CartPole_ContinousVision::~CartPole_ContinousVision()
 
 at::Tensor CartPole_ContinousVision::reset()
 {
-    auto tmp = torch::zeros({ CartPole_Continous::state_dimension(),});
-    mState = tmp.uniform_(-0.05,0.05);
+    draw_initial_state();
     //state[0] = state[1] = state[2] = state[3] = 0.02;
 
     steps_beyond_done = -1;
 
-    mvPreFrames.clear();
-
     //Create an image
-    if ( mRenderCB ) {
-        std::vector<double> pos = {mState[0].item().toDouble(), mState[4].item().toDouble()};
-        std::vector<double> ang = {mState[2].item().toDouble(), mState[6].item().toDouble()};
-        std::vector<unsigned int> rgba;
-        auto &&[w, h] = (*mRenderCB)(pos, ang, rgba);
-        //WARNING: No error check for "rgba"
-        auto imgTensor = torch::from_blob(rgba.data(), {w * h, 4},
-                                          torch::TensorOptions().dtype(torch::kInt8));
-
-        imgTensor = imgTensor.index({torch::indexing::Slice(torch::indexing::None, torch::indexing::None),
-                                     torch::indexing::Slice(2,4)}).clone().toType(torch::kFloat);
-
-        for ( int i=0; i<mPreFramesCount; ++i ) {
-            mvPreFrames.push_back(imgTensor.clone());
-        }
-        std::vector<torch::Tensor> stack(mPreFramesCount+1);
-        std::copy(mvPreFrames.begin(), mvPreFrames.end(), stack.begin());
-        stack[mPreFramesCount] = imgTensor;
+    if ( has_renderer() ) {
+        render_frame();
+        push_frame(true);
 
-        torch::Tensor state_Img = torch::stack(stack, 1);
-        return state_Img.view({-1});
+        auto state_Img = torch::empty({state_dimension()}, torch::TensorOptions().dtype(mStateType));
+        stack_frames(state_Img);
+        return state_Img;
     }
     return mState;
 }
 
 //#include <QImage>
 //#include <QThread>
-Gym_Torch::dType CartPole_ContinousVision::step(at::Tensor action)
+void CartPole_ContinousVision::advance(const at::Tensor &action, float &reward, int &done)
 {
     const int stateDim = CartPole_Continous::state_dimension();
-    auto reward = torch::zeros({1});
-    auto tmp = torch::Tensor();
-    auto done = torch::zeros({1}, torch::TensorOptions().dtype(torch::kInt));
     bool _done = false;
     auto _extra_reward = 0.0;
 
-    for( int i=0; i<stateDim; i+=4 ) {
-        double x = mState[i].item().toDouble();
-        double x_dot = mState[i+1].item().toDouble();
-        double theta = mState[i+2].item().toDouble();
-        double theta_dot = mState[i+3].item().toDouble();
-        double x_tip = 0.0;
-
-        double last_theta = theta;
-
-        auto force = action[i/4].item().toDouble() * force_mag;
-        auto costheta = std::cos(theta);
-        auto sintheta = std::sin(theta);
-
-        /** For the interested reader:
-        * https://coneural.org/florian/papers/05_cart_pole.pdf
-        * **/
-        auto temp = (force + polemass_length * theta_dot * theta_dot * sintheta ) / total_mass;
-        auto thetaAcc = (gravity * sintheta - costheta * temp) /
-                (length * (4.0 / 3.0 - masspole * costheta * costheta / total_mass));
-        auto xacc = temp - polemass_length * thetaAcc * costheta / total_mass;
-
-        if ( kinematics_integrator == "euler") {
-            x = x + tau * x_dot;
-            x_dot = x_dot + tau * xacc;
-            theta = theta + tau * theta_dot;
-            theta_dot = theta_dot + tau * thetaAcc;
-            x_tip = 2*length * std::sin(theta) + x;
-        } else {  // semi-implicit euler
-            x_dot = x_dot + tau * xacc;
-            x = x + tau * x_dot;
-            theta_dot = theta_dot + tau * thetaAcc;
-            theta = theta + tau * theta_dot;
+    double *s = mvPhysState.data();
+    double force[2];            //one per axis
+    with_action(action, [&](const auto *pAct) {
+        for( int i=0; i<stateDim; i+=4 ) {
+            force[i/4] = pAct[i/4] * force_mag;
         }
+    });
 
-        if ( x < -x_threshold ) {
-            x = 2*x_threshold + x;
-        } else if ( x > x_threshold) {
-            x = x - 2*x_threshold;
-        }
+    int executed = 0;
+    while ( executed < substeps && !_done ) {
+        for( int i=0; i<stateDim; i+=4 ) {
+            double last_theta = s[i+2];
+
+            step_axis(s + i, force[i/4]);
 
-        mState[i] = x;
-        mState[i+1] = x_dot;
-        mState[i+2] = theta;
-        mState[i+3] = theta_dot;
+            double &x = s[i];
+            const double theta = s[i+2];
 
-        _done |= (theta < -theta_threshold_radians) || (theta > theta_threshold_radians)
-/*                || (x < -x_threshold) || (x > x_threshold)
-                || (x_tip < -x_threshold) || (x_tip > x_threshold)*/;
+            if ( x < -x_threshold ) {
+                x = 2*x_threshold + x;
+            } else if ( x > x_threshold) {
+                x = x - 2*x_threshold;
+            }
 
-        if ( std::abs(theta) - std::abs(last_theta) < 0.0 ) {
-            _extra_reward += 0.2 * (theta_threshold_radians - std::abs(theta));
+            _done |= (theta < -theta_threshold_radians) || (theta > theta_threshold_radians)
+/*                    || (x < -x_threshold) || (x > x_threshold)
+                    || (x_tip < -x_threshold) || (x_tip > x_threshold)*/;
+
+            if ( std::abs(theta) - std::abs(last_theta) < 0.0 ) {
+                _extra_reward += 0.2 * (theta_threshold_radians - std::abs(theta)) / substeps;
+            }
         }
+        ++executed;
     }
+    const double alive = double(executed) / substeps;
+    ++mStep;
 
-    done[0] = _done ? 1 : 0;
-    if (!_done) {
-        reward[0] = 1.0 + _extra_reward;
-    } else if ( 0 > steps_beyond_done ) {//Pole just fell!
-        steps_beyond_done = 0;
-        reward[0] = 1.0 + _extra_reward;
-    } else {
-        if (steps_beyond_done == 0){
-            std::cout <<
-                "You are calling 'step()' even though this "
-                "environment has already returned done = True. You "
-                "should always call 'reset()' once you receive 'done = "
-                "True' -- any further steps are undefined behavior."
-            << std::endl;
-            steps_beyond_done += 1;
-            reward[0] = 0.0;
-        }
+    finish_step(_done, alive + _extra_reward, reward, done);
+}
+
+void CartPole_ContinousVision::step_into(at::Tensor action, at::Tensor out_state, at::Tensor out_reward,
+                                         at::Tensor out_done)
+{
+    if ( !has_renderer() ) {
+        Gym_Torch::step_into(action, out_state, out_reward, out_done);
+        return;
     }
+    advance(action, *out_reward.data_ptr<float>(), *out_done.data_ptr<int>());
+    render_frame();
+    push_frame(mHead < 0);
+    stack_frames(out_state);
+}
+
+Gym_Torch::dType CartPole_ContinousVision::step(at::Tensor action)
+{
+    auto reward = torch::zeros({1});
+    auto tmp = torch::Tensor();
+    auto done = torch::zeros({1}, torch::TensorOptions().dtype(torch::kInt));
+    advance(action, *reward.data_ptr<float>(), *done.data_ptr<int>());
 
     //Create an image
-    if ( mRenderCB ) {
-        std::vector<double> pos = {mState[0].item().toDouble(), mState[4].item().toDouble()};
-        std::vector<double> ang = {mState[2].item().toDouble(), mState[6].item().toDouble()};
-        std::vector<unsigned int> rgba;
-        auto &&[w, h] = (*mRenderCB)(pos, ang, rgba);
-        //WARNING: No error check for "rgba"
-        auto imgTensor = torch::from_blob(rgba.data(), {w * h, 4},
-                                          torch::TensorOptions().dtype(torch::kInt8));
-
-        imgTensor = imgTensor.clone().toType(torch::kFloat);
-
-//      if ( 0.523 < std::fabs(mState[2].item().toDouble())){
-//            std::cout << "GG" << std::endl;
-//            auto tmpTest = imgTensor.clone().toType(torch::kInt8);
-//            tmpTest = tmpTest.reshape({w, h, 4});
-//            QImage tmpImg((const uchar*)tmpTest.data_ptr(), w, h, QImage::Format_ARGB32);
-//            if ( tmpImg.isNull()) {
-//                std::exit(-1);
-//            }
-//            tmpImg.save("fromTensor.png");
-//            tmpTest = lastImg.clone().toType(torch::kInt8);
-//            tmpTest = tmpTest.reshape({w, h, 4});
-//            tmpImg = QImage((const uchar*)tmpTest.data_ptr(), w, h, QImage::Format_ARGB32);
-//            if ( tmpImg.isNull()) {
-//                std::exit(-1);
-//            }
-//            tmpImg.save("fromTensor_last.png");
-            //QThread::currentThread()->sleep(100000);
-//        }
-
-        imgTensor = imgTensor.index({torch::indexing::Slice(torch::indexing::None, torch::indexing::None),
-                                     torch::indexing::Slice(2,4)});
-
-        if ( int(mvPreFrames.size()) < mPreFramesCount ) {  //The env has been reset()
+    if ( has_renderer() ) {
+        if ( mHead < 0 ) {  //The env has not been reset()
             std::cout << "You are calling 'step()' before reset() the environment."
                          "No previous frame/history recorded!"
                       << std::endl;
         }
+        render_frame();
+        push_frame(mHead < 0);
 
-        std::vector<torch::Tensor> stack(mPreFramesCount+1);
-        std::copy(mvPreFrames.begin(), mvPreFrames.end(), stack.begin());
-        stack[mPreFramesCount] = imgTensor;
-
-        torch::Tensor state_Img = torch::stack(stack, 1);
-
-//        if ( 0.523 < std::fabs(mState[2].item().toDouble())) {
-//            std::cout << state_Img.sizes() << std::endl;
-//            auto test = state_Img.index({0,
-//                        torch::indexing::Slice(torch::indexing::None,torch::indexing::None),
-//                                         0
-//                        }).clone();
-
-//            test = torch::stack({test,
-//                                 torch::zeros({w * h}),
-//                                 torch::zeros({w * h}),
-//                                 test}, 1).toType(torch::kInt8);
-//            std::cout << test.sizes() << std::endl;
-//            auto testimg1 = QImage((const uchar*)test.data_ptr(), w, h, QImage::Format_ARGB32);
-//            if ( testimg1.isNull()) {
-//                std::exit(-1);
-//            }
-//            testimg1.save("fromTensor_BD_last.png");
-//            test = state_Img.index({1,
-//                    torch::indexing::Slice(torch::indexing::None,torch::indexing::None),
-//                                    0
-//                    }).clone();
-//            test = torch::stack({torch::zeros({w * h}),
-//                                 test,
-//                                 torch::zeros({w * h}),
-//                                 test}, 1).toType(torch::kInt8);
-//            auto testimg2 = QImage((const uchar*)test.data_ptr(), w, h, QImage::Format_ARGB32);
-//            if ( testimg2.isNull()) {
-//                std::exit(-1);
-//            }
-//            testimg2.save("fromTensorBD.png");
-//            QThread::currentThread()->sleep(100000);
-//        }
-
-        mvPreFrames.push_back(imgTensor.clone());
-        if ( int(mvPreFrames.size()) > mPreFramesCount) {
-            mvPreFrames.pop_front();
-        }
-
-        return std::make_tuple<>(state_Img.view({-1}), reward, done, tmp);
+        auto state_Img = torch::empty({state_dimension()}, torch::TensorOptions().dtype(mStateType));
+        stack_frames(state_Img);
+        return std::make_tuple<>(state_Img, reward, done, tmp);
     } else {
         std::cout << "No renderer provided. Data-level \"state\" will be returned." << std::endl;
     }
     return std::make_tuple<>(mState, reward, done, tmp);
 }
 
+bool CartPole_ContinousVision::has_renderer() const
+{
+    return mRendererRG || mRenderer || mRenderCB;
+}
+
+void CartPole_ContinousVision::render_frame()
+{
+    for ( int a=0; a<mAxes; ++a ) {
+        mvPos[a] = mvPhysState[4*a];
+        mvAng[a] = mvPhysState[4*a + 2];
+    }
+
+    if ( mRendererRG ) {
+        if ( !mFrame.defined() ) {
+            mFrame = torch::zeros({mWidth * mHeight, 2}, torch::TensorOptions().dtype(torch::kInt8));
+        }
+        (*mRendererRG)({mvPos.data(), mvPos.size()}, {mvAng.data(), mvAng.size()},
+                       {reinterpret_cast<uint8_t*>(mFrame.data_ptr<int8_t>()), size_t(mWidth) * mHeight * 2});
+        return;
+    }
+
+    if ( mRenderer ) {
+        if ( !mFrame.defined() ) {
+            mFrame = torch::zeros({mWidth * mHeight, 4}, torch::TensorOptions().dtype(torch::kInt8));
+        }
+        (*mRenderer)({mvPos.data(), mvPos.size()}, {mvAng.data(), mvAng.size()},
+                     {reinterpret_cast<uint32_t*>(mFrame.data_ptr<int8_t>()), size_t(mWidth) * mHeight});
+        return;
+    }
+
+    std::vector<unsigned int> rgba;
+    auto &&[w, h] = (*mRenderCB)(mvPos, mvAng, rgba);
+    //WARNING: No error check for "rgba"
+    if ( !mFrame.defined() || mFrame.size(0) != int64_t(w) * h || mFrame.size(1) != 4 ) {
+        mFrame = torch::zeros({int64_t(w) * h, 4}, torch::TensorOptions().dtype(torch::kInt8));
+        mWidth = w;
+        mHeight = h;
+    }
+    std::memcpy(mFrame.data_ptr<int8_t>(), rgba.data(), sizeof(unsigned int) * w * h);
+}
+
+void CartPole_ContinousVision::push_frame(bool fill)
+{
+    const int frames = mPreFramesCount + 1;
+    if ( !mHistory.defined() || mHistory.size(1) != mHeight || mHistory.size(2) != mWidth
+         || mHistory.scalar_type() != mStateType ) {
+        mHistory = torch::empty({frames, mHeight, mWidth, 2}, torch::TensorOptions().dtype(mStateType));
+        fill = true;
+    }
+    mHead = fill ? 0 : (mHead + 1) % frames;
+
+    //RG frames are the channels, RGBA frames have them in bytes 2 and 3
+    const int64_t pixels = int64_t(mWidth) * mHeight;
+    const int stride = int(mFrame.size(1));
+    const int8_t *src = mFrame.data_ptr<int8_t>() + (4 == stride ? 2 : 0);
+    const size_t slotBytes = size_t(pixels) * 2 * mHistory.element_size();
+    char *slot = static_cast<char*>(mHistory.data_ptr()) + mHead * slotBytes;
+    if ( torch::kUInt8 == mStateType ) {
+        copy_channels(reinterpret_cast<const uint8_t*>(src), stride, reinterpret_cast<uint8_t*>(slot), pixels);
+    } else {
+        //The float states keep reading the bytes as int8, as they always did
+        copy_channels(src, stride, reinterpret_cast<float*>(slot), pixels);
+    }
+    if ( fill ) {
+        for ( int f=1; f<frames; ++f ) {
+            std::memcpy(slot + f * slotBytes, slot, slotBytes);
+        }
+    }
+}
+
+void CartPole_ContinousVision::stack_frames(at::Tensor out) const
+{
+    const int frames = mPreFramesCount + 1;
+    const int64_t pixels = int64_t(mWidth) * mHeight;
+    if ( !out.is_contiguous() || out.scalar_type() != mStateType || out.numel() != pixels * 2 * frames ) {
+        auto state = torch::empty({pixels * 2 * frames}, torch::TensorOptions().dtype(mStateType));
+        stack_frames(state);
+        out.copy_(state.view_as(out));
+        return;
+    }
+    if ( torch::kUInt8 == mStateType ) {
+        stack_history(mHistory.data_ptr<uint8_t>(), frames, mHead, pixels, out.data_ptr<uint8_t>());
+    } else {
+        stack_history(mHistory.data_ptr<float>(), frames, mHead, pixels, out.data_ptr<float>());
+    }
+}
+
+void CartPole_ContinousVision::setRenderer(Gym_Render_Callback *cb, int width, int height)
+{
+    mRenderer = cb;
+    mRendererRG = nullptr;
+    mRenderCB = nullptr;
+    mWidth = width;
+    mHeight = height;
+    mFrame = torch::Tensor();
+}
+
+void CartPole_ContinousVision::setRenderer(Gym_Render_Callback_RG *cb, int width, int height)
+{
+    mRendererRG = cb;
+    mRenderer = nullptr;
+    mRenderCB = nullptr;
+    mWidth = width;
+    mHeight = height;
+    mFrame = torch::Tensor();
+}
+
 void CartPole_ContinousVision::setRender_Callback(std::function<std::pair<int,int> (std::vector<double>,
                                                                       std::vector<double>,
                                                                       std::vector<unsigned int>&)> *cb)
 {
     mRenderCB = cb;
+    mRenderer = nullptr;
+    mRendererRG = nullptr;
+    mFrame = torch::Tensor();
 }
 
 int CartPole_ContinousVision::state_dimension()
 {
-    //W * H * int(RGB-D)
-    return 128*128*2*2;
+    //W * H * (ambient, depth) * frames
+    return mWidth * mHeight * 2 * (mPreFramesCount + 1);
+}
+
+void CartPole_ContinousVision::set_state_type(torch::ScalarType type)
+{
+    if ( torch::kFloat != type && torch::kUInt8 != type ) {
+        std::cout << "CartPole_ContinousVision states are kFloat or kUInt8, got " << type
+                  << ". kFloat will be used." << std::endl;
+        type = torch::kFloat;
+    }
+    mStateType = type;
+}
+
+torch::ScalarType CartPole_ContinousVision::state_type() const
+{
+    return mStateType;
 }
+
+template<typename T>
+CartPole_BatchT<T>::CartPole_BatchT(int envs, bool b2D, Kinematics_Integrator integrator)
+    :CartPole_Physics(integrator)
+    ,mEnvs(envs)
+    ,mAxes(b2D ? 2 : 1)
+    ,mStride(gym_pad_lanes(envs))
+    ,mSeed(torch_seed())
+{
+    set_isa(gym_best_isa());
+
+    //Padding lanes are stepped along with the real ones and never read back
+    const size_t lanes = size_t(mStride) * mAxes;
+    mvX.assign(lanes, 0.0);
+    mvXDot.assign(lanes, 0.0);
+    mvTheta.assign(lanes, 0.0);
+    mvThetaDot.assign(lanes, 0.0);
+    mvForce.assign(lanes, 0.0);
+    mvDone.assign(lanes, 0);
+    mvSubstepsRun.assign(mEnvs, 0);
+    mvStepsBeyondDone.assign(mEnvs, 0);
+    mvEpisode.assign(mEnvs, uint32_t(-1));
+    mvStep.assign(mEnvs, 0);
+
+    mState = torch::zeros({mEnvs, state_dimension()},
+                          torch::TensorOptions().dtype(scalar_type()));
+    mTerminalState = torch::zeros_like(mState);
+}
+
+template<typename T>
+CartPole_BatchT<T>::~CartPole_BatchT()
+{
+
+}
+
+template<typename T>
+at::Tensor CartPole_BatchT<T>::reset()
+{
+    std::fill(mvDone.begin(), mvDone.end(), 1);
+    reset_done_lanes();
+    gather_state(mState);
+
+    std::fill(mvStepsBeyondDone.begin(), mvStepsBeyondDone.end(), -1);
+    return mState;
+}
+
+template<typename T>
+Gym_Torch::dType CartPole_BatchT<T>::step(at::Tensor action)
+{
+    auto reward = torch::zeros({mEnvs});
+    auto done = torch::zeros({mEnvs}, torch::TensorOptions().dtype(torch::kInt));
+    advance(action, reward.data_ptr<float>(), done.data_ptr<int>());
+
+    auto terminal = mAutoReset ? mTerminalState : torch::Tensor();
+    return std::make_tuple<>(mState, reward, done, terminal);
+}
+
+template<typename T>
+void CartPole_BatchT<T>::step_into(at::Tensor action, at::Tensor out_state, at::Tensor out_reward,
+                                   at::Tensor out_done)
+{
+    TORCH_CHECK(out_reward.numel() == mEnvs && out_done.numel() == mEnvs,
+                "CartPole_Batch::step_into: ", out_reward.numel(), " rewards and ",
+                out_done.numel(), " dones for ", mEnvs, " envs");
+    TORCH_CHECK(out_state.numel() == mState.numel(),
+                "CartPole_Batch::step_into: state of ", out_state.numel(),
+                " elements, expected ", mState.numel());
+    advance(action, out_reward.data_ptr<float>(), out_done.data_ptr<int>());
+    copy_state(mState, out_state);
+}
+
+template<typename T>
+void CartPole_BatchT<T>::advance(const at::Tensor &action, float *pReward, int *pDone)
+{
+    with_action(action, [&](const auto *pAct) {
+        for ( int n=0; n<mEnvs; ++n ) {
+            for ( int a=0; a<mAxes; ++a ) {
+                mvForce[size_t(a) * mStride + n] = T(pAct[n*mAxes + a]) * T(force_mag);
+            }
+        }
+    });
+
+    //Each axis ORs into its own done row, the rows are merged per env after
+    //every substep so that all axes of an env stop at the same substep
+    std::fill(mvDone.begin(), mvDone.end(), 0);
+    std::fill(mvSubstepsRun.begin(), mvSubstepsRun.end(), 0);
+    int running = mEnvs;
+    for ( int k=0; k<substeps && running; ++k ) {
+        for ( int a=0; a<mAxes; ++a ) {
+            const size_t base = size_t(a) * mStride;
+            CartPole_Lanes<T> lanes{&mvX[base], &mvXDot[base], &mvTheta[base], &mvThetaDot[base],
+                                    &mvForce[base], &mvDone[base], mStride};
+            mKernel(*this, lanes);
+        }
+
+        running = 0;
+        for ( int n=0; n<mEnvs; ++n ) {
+            uint8_t d = 0;
+            for ( int a=0; a<mAxes; ++a ) {
+                d |= mvDone[size_t(a) * mStride + n];
+            }
+            for ( int a=0; a<mAxes; ++a ) {
+                mvDone[size_t(a) * mStride + n] = d;
+            }
+            if ( mvSubstepsRun[n] == k ) {//Not done when this substep started
+                mvSubstepsRun[n] = k + 1;
+            }
+            running += !d;
+        }
+    }
+    for ( int n=0; n<mEnvs; ++n ) {
+        ++mvStep[n];
+    }
+
+    if ( mAutoReset ) {
+        gather_state(mTerminalState);
+        reset_done_lanes();
+    }
+    gather_state(mState);
+
+    bool warn = false;
+    for ( int n=0; n<mEnvs; ++n ) {
+        const float alive = float(mvSubstepsRun[n]) / substeps;
+        pDone[n] = mvDone[n];
+        pReward[n] = 0.0f;
+        if (!mvDone[n]) {
+            pReward[n] = alive;
+        } else if ( 0 > mvStepsBeyondDone[n] ) {//Pole just fell!
+            mvStepsBeyondDone[n] = mAutoReset ? -1 : 0;
+            pReward[n] = alive;
+        } else if ( mvStepsBeyondDone[n] == 0 ) {
+            warn = true;
+            mvStepsBeyondDone[n] += 1;
+        }
+    }
+    if ( warn ) {
+        std::cout <<
+            "You are calling 'step()' even though some "
+            "environments have already returned done = True. You "
+            "should always call 'reset()' once you receive 'done = "
+            "True' -- any further steps are undefined behavior."
+        << std::endl;
+    }
+}
+
+template<typename T>
+at::Tensor CartPole_BatchT<T>::sample_action()
+{
+    //Same draws as CartPole_Continous::sample_action() of env mEnvId + n
+    auto action = torch::empty({mEnvs, mAxes});
+    float *pAct = action.data_ptr<float>();
+    for ( int n=0; n<mEnvs; ++n ) {
+        for ( int a=0; a<mAxes; a+=2 ) {
+            double v[2];
+            action_pair(mSeed, mEnvId + uint32_t(n), mvEpisode[n], mvStep[n], uint32_t(a/2), v);
+            pAct[n*mAxes + a] = float(v[0]);
+            if ( a + 1 < mAxes ) {
+                pAct[n*mAxes + a + 1] = float(v[1]);
+            }
+        }
+    }
+    return action;
+}
+
+template<typename T>
+void CartPole_BatchT<T>::seed(uint64_t seed, uint32_t envId)
+{
+    mSeed = seed;
+    mEnvId = envId;
+    std::fill(mvEpisode.begin(), mvEpisode.end(), uint32_t(-1));
+    std::fill(mvStep.begin(), mvStep.end(), 0);
+}
+
+template<typename T>
+uint32_t CartPole_BatchT<T>::env_ids() const
+{
+    return uint32_t(mEnvs);
+}
+
+template<typename T>
+int CartPole_BatchT<T>::action_dimension()
+{
+    return mAxes;
+}
+
+template<typename T>
+int CartPole_BatchT<T>::state_dimension()
+{
+    return 4 * mAxes;
+}
+
+template<typename T>
+void CartPole_BatchT<T>::set_substeps(int k)
+{
+    if ( 1 > k ) {
+        std::cout << "At least one substep per step is needed, got " << k
+                  << ". One substep will be used." << std::endl;
+        k = 1;
+    }
+    substeps = k;
+}
+
+template<typename T>
+int CartPole_BatchT<T>::substep_count() const
+{
+    return substeps;
+}
+
+template<typename T>
+at::Tensor CartPole_BatchT<T>::terminal_state() const
+{
+    return mTerminalState;
+}
+
+template<typename T>
+void CartPole_BatchT<T>::set_auto_reset(bool enable)
+{
+    mAutoReset = enable;
+}
+
+template<typename T>
+bool CartPole_BatchT<T>::auto_reset() const
+{
+    return mAutoReset;
+}
+
+template<typename T>
+int CartPole_BatchT<T>::env_count() const
+{
+    return mEnvs;
+}
+
+template<typename T>
+void CartPole_BatchT<T>::set_isa(Gym_ISA isa)
+{
+    if ( !gym_isa_supported(isa) ) {
+        std::cout << "Instruction set \"" << gym_isa_name(isa) << "\" is not supported "
+                     "by this CPU. The scalar kernel will be used." << std::endl;
+        isa = Gym_ISA::Scalar;
+    }
+    mIsa = isa;
+    mKernel = cartpole_kernel<T>(mIsa, kinematics_integrator, mSincos);
+}
+
+template<typename T>
+Gym_ISA CartPole_BatchT<T>::isa() const
+{
+    return mIsa;
+}
+
+template<typename T>
+void CartPole_BatchT<T>::set_sincos_mode(Sincos_Mode mode)
+{
+    mSincos = mode;
+    mKernel = cartpole_kernel<T>(mIsa, kinematics_integrator, mSincos);
+}
+
+template<typename T>
+Sincos_Mode CartPole_BatchT<T>::sincos_mode() const
+{
+    return mSincos;
+}
+
+template<typename T>
+void CartPole_BatchT<T>::scatter_state()
+{
+    const T *s = mState.data_ptr<T>();
+    const int stateDim = 4 * mAxes;
+    for ( int n=0; n<mEnvs; ++n ) {
+        for ( int a=0; a<mAxes; ++a ) {
+            const size_t i = size_t(a) * mStride + n;
+            const T *p = s + size_t(n) * stateDim + a*4;
+            mvX[i] = p[0];
+            mvXDot[i] = p[1];
+            mvTheta[i] = p[2];
+            mvThetaDot[i] = p[3];
+        }
+    }
+}
+
+template<typename T>
+void CartPole_BatchT<T>::gather_state(const torch::Tensor &state)
+{
+    T *s = state.data_ptr<T>();
+    const int stateDim = 4 * mAxes;
+    for ( int n=0; n<mEnvs; ++n ) {
+        for ( int a=0; a<mAxes; ++a ) {
+            const size_t i = size_t(a) * mStride + n;
+            T *p = s + size_t(n) * stateDim + a*4;
+            p[0] = mvX[i];
+            p[1] = mvXDot[i];
+            p[2] = mvTheta[i];
+            p[3] = mvThetaDot[i];
+        }
+    }
+}
+
+template<typename T>
+void CartPole_BatchT<T>::reset_done_lanes()
+{
+    //The done rows are merged per env, so every lane knows whether its env
+    //ended. All lanes draw the initial state of their env's next episode and
+    //the done ones take it; the loops have no data dependent branch.
+    const uint8_t *done = mvDone.data();
+    for ( int n=0; n<mEnvs; ++n ) {
+        const uint32_t d = 0 != done[n];
+        mvEpisode[n] += d;
+        mvStep[n] &= d - 1u;
+    }
+
+    for ( int a=0; a<mAxes; ++a ) {
+        const size_t base = size_t(a) * mStride;
+        for ( int n=0; n<mEnvs; ++n ) {
+            const size_t i = base + n;
+            double v[4];
+            initial_pair(mSeed, mEnvId + uint32_t(n), mvEpisode[n], uint32_t(2*a), v);
+            initial_pair(mSeed, mEnvId + uint32_t(n), mvEpisode[n], uint32_t(2*a + 1), v + 2);
+
+            mvX[i] = lane_blend(done[i], mvX[i], T(v[0]));
+            mvXDot[i] = lane_blend(done[i], mvXDot[i], T(v[1]));
+            mvTheta[i] = lane_blend(done[i], mvTheta[i], T(v[2]));
+            mvThetaDot[i] = lane_blend(done[i], mvThetaDot[i], T(v[3]));
+        }
+    }
+}
+
+template<typename T>
+torch::ScalarType CartPole_BatchT<T>::scalar_type()
+{
+    return std::is_same<T, float>::value ? torch::kFloat : torch::kDouble;
+}
+
+template class CartPole_BatchT<double>;
+template class CartPole_BatchT<float>;
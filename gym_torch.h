@@ -2,6 +2,10 @@
 #define GYM_TORCH_H
 
 #include <torch/torch.h>
+#include "gym_physics.h"
+#include "gym_render.h"
+#include "gym_rng.h"
+#include "gym_simd.h"
 
 
 class Gym_Torch
@@ -20,14 +24,45 @@ public:
     virtual torch::Tensor sample_action() = 0;
     virtual int action_dimension() = 0;
     virtual int state_dimension() = 0;
+    /**
+     * Key reset() and sample_action() to (seed, envId, episode, step), see
+     * gym_rng.h. The next reset() starts episode 0. Envs that are never
+     * seeded draw their seed from the torch generator at construction.
+     */
+    virtual void seed(uint64_t seed, uint32_t envId = 0) = 0;
+    /**
+     * Env ids seed() keys, envId .. envId + env_ids() - 1. Containers of
+     * several envs seed them at consecutive, non-overlapping id ranges.
+     */
+    virtual uint32_t env_ids() const { return 1; }
+
+    /**
+     * step() writing into caller owned tensors instead of returning new ones:
+     * out_state as state_dimension() (float or double), out_reward as float
+     * and out_done as int, shaped like the tensors step() returns. The
+     * CartPole environments do not allocate here once running; this default
+     * calls step() and copies.
+     */
+    virtual void step_into(torch::Tensor action, torch::Tensor out_state,
+                           torch::Tensor out_reward, torch::Tensor out_done)
+    {
+        auto result = step(action);
+        out_state.copy_(std::get<0>(result).view_as(out_state));
+        out_reward.copy_(std::get<1>(result).view_as(out_reward));
+        out_done.copy_(std::get<2>(result).view_as(out_done));
+    }
 
     torch::Tensor mState;
 };
 
-class CartPole : public Gym_Torch
+class CartPole : public Gym_Torch, protected CartPole_Physics
 {
 public:
+    explicit CartPole(Kinematics_Integrator integrator = Kinematics_Integrator::Euler);
     virtual ~CartPole();
+    //mState mirrors mvPhysState, a copy would publish into the source's tensor
+    CartPole(const CartPole &) = delete;
+    CartPole &operator=(const CartPole &) = delete;
 
     // Gym_Torch interface
     virtual torch::Tensor reset() override;
@@ -35,63 +70,233 @@ public:
     virtual torch::Tensor sample_action() override;
     virtual int action_dimension() override;
     virtual int state_dimension() override;
+    virtual void seed(uint64_t seed, uint32_t envId = 0) override;
+    virtual void step_into(torch::Tensor action, torch::Tensor out_state,
+                           torch::Tensor out_reward, torch::Tensor out_done) override;
+
+    /**
+     * Integrate k substeps of tau / k per step() (1 by default). The action is
+     * held over the substeps, integration stops at the substep the episode
+     * ends in and the reward is the fraction of substeps run, so a step the
+     * pole survives is still worth 1.
+     */
+    void set_substeps(int k);
+    int substep_count() const;
 
 protected:
-    const double gravity = 9.8;
-    const double masscart = 1.0;
-    const double masspole = 0.1;
-    const double total_mass = masspole + masscart;
-    const double length = 1.0;    // actually half the pole's length
-    const double polemass_length = masspole * length;
-    const double force_mag = 3*10.0;
-    const double tau = 1.0/30.0;  //seconds between state updates 60Hz
-
-    const double theta_threshold_radians = 45.0 * M_PI / 180.0;
-    const double x_threshold = 4 * 2.4;
-
-    const std::string kinematics_integrator = "euler";
+    //Allocate the double physics state and its float mirror "mState"
+    void bind_state(int dim);
+    //mState = float(mvPhysState), once per reset()/step()
+    void publish_state();
+    //Start the next episode from its counter-based initial state
+    void draw_initial_state();
+    //The physics of step(), writing reward and done in place
+    virtual void advance(const torch::Tensor &action, float &reward, int &done);
+    //Reward/done bookkeeping at the end of advance()
+    void finish_step(bool _done, double alive, float &reward, int &done);
+
+    std::vector<double> mvPhysState;
     int8_t steps_beyond_done = 0;
+
+    uint64_t mSeed;
+    uint32_t mEnvId = 0;
+    uint32_t mEpisode = uint32_t(-1);
+    uint32_t mStep = 0;
 };
 
+/**
+ * Continuous cart-pole with 1..k independent axes (b2D picks 1 or 2). The
+ * state is [x, x_dot, theta, theta_dot] per axis and the action one force per
+ * axis; the episode ends when any axis fails. All axes are advanced by one
+ * call of the vectorized kernel of gym_simd.h.
+ */
 class CartPole_Continous : public CartPole
 {
 public:
-    explicit CartPole_Continous(bool b2D = true);
+    explicit CartPole_Continous(bool b2D = true,
+                                Kinematics_Integrator integrator = Kinematics_Integrator::Euler);
+    explicit CartPole_Continous(int axes,
+                                Kinematics_Integrator integrator = Kinematics_Integrator::Euler);
     virtual ~CartPole_Continous();
 
     // Gym_Torch interface
     virtual torch::Tensor reset() override;
-    virtual dType step(torch::Tensor action) override;
     virtual torch::Tensor sample_action() override;
     virtual int action_dimension() override;
     virtual int state_dimension() override;
 
+    int axis_count() const;
+
 protected:
-    bool m_b2D;
+    virtual void advance(const torch::Tensor &action, float &reward, int &done) override;
+
+    int mAxes;
+
+private:
+    //Axes in struct-of-arrays layout for the kernel: x, x_dot, theta,
+    //theta_dot and force, mStride lanes each
+    int mStride;
+    CartPole_Kernel<double> mKernel;
+    std::vector<double> mvLanes;
+    std::vector<uint8_t> mvDone;
 };
 
 class CartPole_ContinousVision : public CartPole_Continous
 {
 public:
-    explicit CartPole_ContinousVision(bool b2D = true, int preFramesCount = 1);
+    explicit CartPole_ContinousVision(bool b2D = true, int preFramesCount = 1,
+                                      Kinematics_Integrator integrator = Kinematics_Integrator::Euler);
     virtual ~CartPole_ContinousVision();
 
     // Gym_Torch interface
     virtual torch::Tensor reset() override;
     virtual dType step(torch::Tensor action) override;
+    virtual void step_into(torch::Tensor action, torch::Tensor out_state,
+                           torch::Tensor out_reward, torch::Tensor out_done) override;
+    /**
+     * Frames of width x height pixels rendered by cb into the env's own frame
+     * buffer. Each setter replaces the renderer set by any of the other two
+     */
+    void setRenderer(Gym_Render_Callback *cb, int width = 128, int height = 128);
+    /** Frames of (ambient, depth) pairs, used as rendered without slicing */
+    void setRenderer(Gym_Render_Callback_RG *cb, int width = 128, int height = 128);
+    //Older interface, allocates the pose vectors and a frame per call
     void setRender_Callback(std::function<std::pair<int,int> (std::vector<double>,
                                                 std::vector<double>,
                                                 std::vector<unsigned int>&)> *cb);
     // Gym_Torch interface
     int state_dimension() override;
 
+    /**
+     * Scalar type of the states: kFloat (default) or kUInt8, which keeps the
+     * pixels as bytes in [0, 255] and leaves the conversion to the model
+     * input, a quarter of the memory per state. Takes effect at the next
+     * reset().
+     */
+    void set_state_type(torch::ScalarType type);
+    torch::ScalarType state_type() const;
+
+protected:
+    virtual void advance(const torch::Tensor &action, float &reward, int &done) override;
+
+    bool has_renderer() const;
+    //Renders the current pose into mFrame
+    void render_frame();
+    //Writes the (ambient, depth) channels of mFrame into the next history
+    //slot, or into every slot when fill is set (reset)
+    void push_frame(bool fill);
+    //History oldest to newest into out, laid out as [H * W, frames, 2].
+    //Plain loops over the data, so a step creates no tensors.
+    void stack_frames(torch::Tensor out) const;
+
 private:
+    Gym_Render_Callback *mRenderer = nullptr;
+    Gym_Render_Callback_RG *mRendererRG = nullptr;
     std::function<std::pair<int,int>(std::vector<double>,
                        std::vector<double>,
                        std::vector<unsigned int>&)> *mRenderCB = nullptr;
+    int mWidth = 128;
+    int mHeight = 128;
+    torch::Tensor mFrame;               //RGBA words or RG pairs, written by the renderer in place
+    std::vector<double> mvPos;          //pose of each axis, reused every frame
+    std::vector<double> mvAng;
 
-    std::deque<torch::Tensor> mvPreFrames;
+    //[frames, H, W, 2] ring of (ambient, depth), mHead is the newest slot
+    torch::Tensor mHistory;
+    int mHead = -1;
+    torch::ScalarType mStateType = torch::kFloat;
     int mPreFramesCount = 1;
 };
 
+/**
+ * N CartPole_Continous environments advanced together. The physics state is
+ * kept as struct-of-arrays (one array per state variable, indexed by
+ * axis * stride + env with stride = N padded for the SIMD kernels) and all
+ * envs are stepped in one call of the vectorized kernel.
+ * reset()/step() use [N, state_dimension()] states, [N, action_dimension()]
+ * actions and [N] rewards/dones.
+ * T is the scalar type of the physics state and of mState: CartPole_Batch
+ * (double) matches CartPole_Continous, CartPole_Batch32 (float) runs twice
+ * the SIMD lanes per instruction on half the memory. Over 500-step balanced
+ * episodes float states stay within 1e-6 of the double ones (gym_bench
+ * checks it).
+ * With set_auto_reset(true) finished envs restart inside step(): the
+ * returned state holds their new initial state and the reserved (4th)
+ * tensor of the tuple the terminal state of every env (valid for the rows
+ * with done = 1).
+ */
+template<typename T>
+class CartPole_BatchT : public Gym_Torch, protected CartPole_Physics
+{
+public:
+    explicit CartPole_BatchT(int envs, bool b2D = true,
+                             Kinematics_Integrator integrator = Kinematics_Integrator::Euler);
+    virtual ~CartPole_BatchT();
+
+    // Gym_Torch interface
+    virtual torch::Tensor reset() override;
+    virtual dType step(torch::Tensor action) override;
+    virtual void step_into(torch::Tensor action, torch::Tensor out_state,
+                           torch::Tensor out_reward, torch::Tensor out_done) override;
+    virtual torch::Tensor sample_action() override;
+    virtual int action_dimension() override;
+    virtual int state_dimension() override;
+    //Env n is keyed as env id envId + n
+    virtual void seed(uint64_t seed, uint32_t envId = 0) override;
+    virtual uint32_t env_ids() const override;
+
+    int env_count() const;
+    //Substeps of tau / k per step(), see CartPole::set_substeps()
+    void set_substeps(int k);
+    int substep_count() const;
+    void set_auto_reset(bool enable);
+    bool auto_reset() const;
+    //Terminal states of the last step() / step_into() with auto reset on
+    torch::Tensor terminal_state() const;
+    //Override the kernel picked at construction (gym_best_isa())
+    void set_isa(Gym_ISA isa);
+    Gym_ISA isa() const;
+    //Libm (default) matches CartPole_Continous exactly, see Sincos_Mode
+    void set_sincos_mode(Sincos_Mode mode);
+    Sincos_Mode sincos_mode() const;
+
+protected:
+    //The physics of step(), writing [N] rewards and dones in place
+    void advance(const torch::Tensor &action, float *reward, int *done);
+    void scatter_state();   //mState -> SoA
+    void gather_state(const torch::Tensor &state);    //SoA -> state
+    //Start the next episode of the done envs, no branch per lane
+    void reset_done_lanes();
+    static torch::ScalarType scalar_type();   //dtype of mState
+
+    int mEnvs;
+    int mAxes;
+    int mStride;
+    Gym_ISA mIsa;
+    Sincos_Mode mSincos = Sincos_Mode::Libm;
+    CartPole_Kernel<T> mKernel;
+    bool mAutoReset = false;
+    torch::Tensor mTerminalState;
+
+    std::vector<T> mvX;
+    std::vector<T> mvXDot;
+    std::vector<T> mvTheta;
+    std::vector<T> mvThetaDot;
+    std::vector<T> mvForce;
+    std::vector<uint8_t> mvDone;        //One row of mStride per axis
+    std::vector<int> mvSubstepsRun;
+    std::vector<int8_t> mvStepsBeyondDone;
+
+    uint64_t mSeed;
+    uint32_t mEnvId = 0;
+    std::vector<uint32_t> mvEpisode;
+    std::vector<uint32_t> mvStep;
+};
+
+extern template class CartPole_BatchT<double>;
+extern template class CartPole_BatchT<float>;
+
+using CartPole_Batch = CartPole_BatchT<double>;
+using CartPole_Batch32 = CartPole_BatchT<float>;
+
 #endif // GYM_TORCH_H
@@ -0,0 +1,689 @@
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "gym_threads.h"
+#include "gym_vector_env.h"
+
+namespace {
+
+//One draw from the torch generator, on the calling thread
+uint64_t torch_seed()
+{
+    auto words = torch::randint(0, int64_t(1) << 32, {2}, torch::TensorOptions().dtype(torch::kLong));
+    const int64_t *w = words.data_ptr<int64_t>();
+    return (uint64_t(w[0]) << 32) | uint64_t(w[1]);
+}
+
+}
+
+Gym_WorkerPool::Gym_WorkerPool(int workers, const std::vector<int> &cores)
+    :mStats(new Worker_Stats[std::max(1, workers)])
+    ,mStatsSinceNs(Clock::now().time_since_epoch().count())
+{
+    workers = std::max(1, workers);
+    mvThreads.reserve(workers);
+    for ( int w=0; w<workers; ++w ) {
+        const int core = cores.empty() ? -1 : cores[w % cores.size()];
+        mvThreads.emplace_back(&Gym_WorkerPool::worker_loop, this, w, core);
+    }
+}
+
+Gym_WorkerPool::~Gym_WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mWake.notify_all();
+    for ( auto &t : mvThreads ) {
+        t.join();
+    }
+}
+
+int Gym_WorkerPool::worker_count() const
+{
+    return int(mvThreads.size());
+}
+
+uint64_t Gym_WorkerPool::submit(int count, const std::function<void(int)> &body)
+{
+    uint64_t ticket;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ticket = mFirstTicket + mJobs.size();
+        const int workers = worker_count();
+        Job job{&body, mSteal, workers, false, nullptr,
+                std::unique_ptr<Worker_Range[]>(new Worker_Range[workers])};
+        for ( int w=0; w<workers; ++w ) {
+            const uint64_t begin = uint64_t(int64_t(count) * w / workers);
+            const uint64_t end = uint64_t(int64_t(count) * (w + 1) / workers);
+            job.ranges[w].span.store(begin << 32 | end, std::memory_order_relaxed);
+        }
+        mJobs.push_back(std::move(job));
+    }
+    mWake.notify_all();
+    return ticket;
+}
+
+void Gym_WorkerPool::wait(uint64_t ticket)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    Job &job = mJobs[ticket - mFirstTicket];
+    mDone.wait(lock, [&job]{ return 0 == job.pending; });
+    job.waited = true;
+    std::exception_ptr error = job.error;
+
+    //Jobs finish in ticket order, so finished ones are always at the front
+    while ( !mJobs.empty() && mJobs.front().waited ) {
+        mJobs.pop_front();
+        ++mFirstTicket;
+    }
+    lock.unlock();
+
+    if ( error ) {
+        std::rethrow_exception(error);
+    }
+}
+
+bool Gym_WorkerPool::try_wait(uint64_t ticket)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if ( 0 != mJobs[ticket - mFirstTicket].pending ) {
+            return false;
+        }
+    }
+    wait(ticket);
+    return true;
+}
+
+void Gym_WorkerPool::run(int count, const std::function<void(int)> &body)
+{
+    wait(submit(count, body));
+}
+
+void Gym_WorkerPool::set_work_stealing(bool steal)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSteal = steal;
+}
+
+bool Gym_WorkerPool::work_stealing() const
+{
+    return mSteal;
+}
+
+bool Gym_WorkerPool::take_front(Worker_Range &range, int &i)
+{
+    uint64_t span = range.span.load(std::memory_order_acquire);
+    for (;;) {
+        const uint32_t head = uint32_t(span >> 32);
+        const uint32_t tail = uint32_t(span);
+        if ( head >= tail ) {
+            return false;
+        }
+        if ( range.span.compare_exchange_weak(span, uint64_t(head + 1) << 32 | tail,
+                                              std::memory_order_acq_rel) ) {
+            i = int(head);
+            return true;
+        }
+    }
+}
+
+bool Gym_WorkerPool::steal(Worker_Range *ranges, int w, int &i) const
+{
+    const int workers = worker_count();
+    for ( int k=1; k<workers; ++k ) {
+        Worker_Range &victim = ranges[(w + k) % workers];
+        uint64_t span = victim.span.load(std::memory_order_acquire);
+        for (;;) {
+            const uint32_t head = uint32_t(span >> 32);
+            const uint32_t tail = uint32_t(span);
+            if ( head >= tail ) {
+                break;
+            }
+            const uint32_t half = (tail - head + 1) / 2;
+            if ( victim.span.compare_exchange_weak(span, uint64_t(head) << 32 | (tail - half),
+                                                   std::memory_order_acq_rel) ) {
+                //Our deque is empty and only we fill it: run the first index,
+                //queue the rest
+                i = int(tail - half);
+                ranges[w].span.store(uint64_t(tail - half + 1) << 32 | tail, std::memory_order_release);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void Gym_WorkerPool::worker_loop(int w, int core)
+{
+    if ( 0 <= core && !Gym_ThreadBudget::pin_current_thread(core) ) {
+        std::cout << "Gym_WorkerPool: could not pin worker " << w << " to core " << core
+                  << ", it runs unpinned." << std::endl;
+    }
+
+    uint64_t next = 0;
+    for (;;) {
+        const std::function<void(int)> *body;
+        Worker_Range *ranges;
+        bool steals;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mWake.wait(lock, [&]{ return mStop || next < mFirstTicket + mJobs.size(); });
+            if ( mStop ) {
+                return;
+            }
+            const Job &job = mJobs[next - mFirstTicket];
+            body = job.body;
+            ranges = job.ranges.get();
+            steals = job.steal;
+        }
+
+        std::exception_ptr error;
+        const auto t0 = Clock::now();
+        try {
+            int i;
+            while ( take_front(ranges[w], i) || (steals && steal(ranges, w, i)) ) {
+                (*body)(i);
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        mStats[w].busyNs += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count();
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        Job &job = mJobs[next - mFirstTicket];
+        if ( error && !job.error ) {
+            job.error = error;
+        }
+        if ( 0 == --job.pending ) {
+            mDone.notify_all();
+        }
+        ++next;
+    }
+}
+
+std::vector<double> Gym_WorkerPool::utilization() const
+{
+    const int64_t wallNs = Clock::now().time_since_epoch().count() - mStatsSinceNs;
+    std::vector<double> busy(mvThreads.size());
+    for ( size_t w=0; w<busy.size(); ++w ) {
+        busy[w] = 0 < wallNs ? double(mStats[w].busyNs) / wallNs : 0.0;
+    }
+    return busy;
+}
+
+void Gym_WorkerPool::reset_utilization()
+{
+    for ( size_t w=0; w<mvThreads.size(); ++w ) {
+        mStats[w].busyNs = 0;
+    }
+    mStatsSinceNs = Clock::now().time_since_epoch().count();
+}
+
+Gym_VectorEnv::Gym_VectorEnv(std::vector<std::unique_ptr<Gym_Torch>> envs, int workers,
+                             torch::ScalarType stateType)
+    :mvEnvs(std::move(envs))
+    ,mPool(0 < workers ? workers : int(std::max(1u, std::thread::hardware_concurrency())))
+{
+    init_buffers(stateType);
+}
+
+Gym_VectorEnv::Gym_VectorEnv(const Factory &factory, int envs, const std::vector<int> &cores,
+                             torch::ScalarType stateType)
+    :mPool(cores.empty() ? int(std::max(1u, std::thread::hardware_concurrency())) : int(cores.size()),
+           cores)
+{
+    if ( !cores.empty() ) {
+        mPool.set_work_stealing(false);
+    }
+    mvEnvs.resize(std::max(0, envs));
+    run_owned(env_count(), [this, &factory](int i) { mvEnvs[i] = factory(i); });
+    init_buffers(stateType);
+}
+
+void Gym_VectorEnv::run_owned(int count, const std::function<void(int)> &body)
+{
+    const bool steal = mPool.work_stealing();
+    mPool.set_work_stealing(false);
+    try {
+        mPool.run(count, body);
+    } catch (...) {
+        mPool.set_work_stealing(steal);
+        throw;
+    }
+    mPool.set_work_stealing(steal);
+}
+
+void Gym_VectorEnv::init_buffers(torch::ScalarType stateType)
+{
+    if ( mvEnvs.empty() ) {
+        throw std::invalid_argument("Gym_VectorEnv needs at least one environment");
+    }
+    const int envCount = env_count();
+    const int actionDim = mvEnvs[0]->action_dimension();
+    const int stateDim = mvEnvs[0]->state_dimension();
+    for ( auto &e : mvEnvs ) {
+        if ( e->action_dimension() != actionDim || e->state_dimension() != stateDim ) {
+            throw std::invalid_argument("Gym_VectorEnv needs environments of equal "
+                                        "state and action dimensions");
+        }
+        //Each env owns one row, a batch of envs would write over its neighbours'
+        if ( 1 != e->env_ids() ) {
+            throw std::invalid_argument("Gym_VectorEnv needs single environments, "
+                                        "not batches of " + std::to_string(e->env_ids()));
+        }
+    }
+
+    //Left untouched here, the owning workers zero their rows below
+    mState = torch::empty({envCount, stateDim}, torch::TensorOptions().dtype(stateType));
+    mActions = torch::empty({envCount, actionDim});
+    mReward = torch::empty({envCount});
+    mDone = torch::empty({envCount}, torch::TensorOptions().dtype(torch::kInt));
+
+    mvActionRows.reserve(envCount);
+    mvStateRows.reserve(envCount);
+    mvRewardRows.reserve(envCount);
+    mvDoneRows.reserve(envCount);
+    for ( int i=0; i<envCount; ++i ) {
+        mvActionRows.push_back(mActions.select(0, i));
+        mvStateRows.push_back(mState.select(0, i));
+        mvRewardRows.push_back(mReward.narrow(0, i, 1));
+        mvDoneRows.push_back(mDone.narrow(0, i, 1));
+    }
+    run_owned(envCount, [this](int i) {
+        mvActionRows[i].zero_();
+        mvStateRows[i].zero_();
+        mvRewardRows[i].zero_();
+        mvDoneRows[i].zero_();
+    });
+
+    mResetBody = [this](int i) {
+        mvStateRows[i].copy_(mvEnvs[i]->reset().view_as(mvStateRows[i]));
+    };
+    mStepBody = [this](int i) {
+        mvEnvs[i]->step_into(mvActionRows[i], mvStateRows[i], mvRewardRows[i], mvDoneRows[i]);
+    };
+    mSampleBody = [this](int i) {
+        mvActionRows[i].copy_(mvEnvs[i]->sample_action().view_as(mvActionRows[i]));
+    };
+
+    set_groups(1);
+    mReady.reset(new Gym_MpscQueue<int>(size_t(envCount)));
+    mvEnvInFlight.assign(envCount, 0);
+    set_batch_size(envCount);
+
+    //Envs built on the workers drew their seeds in whatever order the
+    //workers ran; one draw here makes them a function of the torch seed
+    seed(torch_seed());
+}
+
+Gym_VectorEnv::~Gym_VectorEnv()
+{
+    try {
+        reap_sends(true);
+    } catch (...) {
+    }
+    //The pool must not be left with queued jobs that point at our bodies
+    for ( auto &g : mvGroups ) {
+        if ( g.inFlight ) {
+            try {
+                mPool.wait(g.ticket);
+            } catch (...) {
+            }
+        }
+    }
+}
+
+void Gym_VectorEnv::check_idle(const char *call) const
+{
+    if ( 0 < mInFlight ) {
+        throw std::logic_error(std::string("Gym_VectorEnv::") + call +
+                               " called while envs are in flight, recv() them first");
+    }
+    for ( auto &g : mvGroups ) {
+        if ( g.inFlight ) {
+            throw std::logic_error(std::string("Gym_VectorEnv::") + call +
+                                   " called while a group is stepping, step_wait() first");
+        }
+    }
+}
+
+void Gym_VectorEnv::set_groups(int groups)
+{
+    check_idle("set_groups()");
+    groups = std::max(1, std::min(groups, env_count()));
+
+    mvGroups.clear();
+    mvGroups.reserve(groups);
+    for ( int g=0; g<groups; ++g ) {
+        const int begin = int(int64_t(env_count()) * g / groups);
+        const int size = int(int64_t(env_count()) * (g + 1) / groups) - begin;
+        Env_Group group;
+        group.begin = begin;
+        group.size = size;
+        group.actions = mActions.narrow(0, begin, size);
+        group.state = mState.narrow(0, begin, size);
+        group.reward = mReward.narrow(0, begin, size);
+        group.done = mDone.narrow(0, begin, size);
+        group.stepBody = [this, begin](int i) { mStepBody(begin + i); };
+        group.inFlight = false;
+        group.ticket = 0;
+        mvGroups.push_back(std::move(group));
+    }
+}
+
+int Gym_VectorEnv::group_count() const
+{
+    return int(mvGroups.size());
+}
+
+int Gym_VectorEnv::group_begin(int group) const
+{
+    return mvGroups.at(group).begin;
+}
+
+int Gym_VectorEnv::group_size(int group) const
+{
+    return mvGroups.at(group).size;
+}
+
+void Gym_VectorEnv::step_async(at::Tensor action, int group)
+{
+    Env_Group &g = mvGroups.at(group);
+    if ( g.inFlight ) {
+        throw std::logic_error("Gym_VectorEnv::step_async() called twice for a group, "
+                               "step_wait() first");
+    }
+    //An env must not be stepped by a group job and a send job at once
+    for ( int i=g.begin; i<g.begin+g.size; ++i ) {
+        if ( mvEnvInFlight[i] ) {
+            throw std::logic_error("Gym_VectorEnv::step_async() called while env " + std::to_string(i) +
+                                   " is in flight, recv() it first");
+        }
+    }
+    //Copied now, the caller may reuse action right away
+    g.actions.copy_(action.view_as(g.actions));
+    g.ticket = mPool.submit(g.size, g.stepBody);
+    g.inFlight = true;
+}
+
+Gym_Torch::dType Gym_VectorEnv::step_wait(int group)
+{
+    Env_Group &g = mvGroups.at(group);
+    if ( !g.inFlight ) {
+        throw std::logic_error("Gym_VectorEnv::step_wait() without step_async()");
+    }
+    g.inFlight = false;
+    mPool.wait(g.ticket);
+    return std::make_tuple<>(g.state, g.reward, g.done, torch::Tensor());
+}
+
+void Gym_VectorEnv::set_batch_size(int batchSize)
+{
+    check_idle("set_batch_size()");
+    mBatchSize = std::max(1, std::min(batchSize, env_count()));
+    mBatchState = torch::zeros({mBatchSize, state_dimension()}, mState.options());
+    mBatchReward = torch::zeros({mBatchSize});
+    mBatchDone = torch::zeros({mBatchSize}, torch::TensorOptions().dtype(torch::kInt));
+    mBatchIds = torch::zeros({mBatchSize}, torch::TensorOptions().dtype(torch::kLong));
+}
+
+int Gym_VectorEnv::batch_size() const
+{
+    return mBatchSize;
+}
+
+void Gym_VectorEnv::dispatch(std::vector<int> ids, const torch::Tensor &action, bool reset)
+{
+    for ( auto &g : mvGroups ) {
+        if ( g.inFlight ) {
+            throw std::logic_error("Gym_VectorEnv::send() called while a group is stepping, "
+                                   "step_wait() first");
+        }
+    }
+    //Before marking ids: a job that threw here must not strand them in flight
+    reap_sends(false);
+    //Shape checked up front too, nothing may throw between marking and submitting
+    const auto act = action.defined() ? action.view({int64_t(ids.size()), -1}) : action;
+
+    //Marking as we go also catches ids repeated within this send()
+    for ( size_t k=0; k<ids.size(); ++k ) {
+        const int id = ids[k];
+        const bool bad = id < 0 || env_count() <= id || mvEnvInFlight[id];
+        if ( bad ) {
+            for ( size_t j=0; j<k; ++j ) {
+                mvEnvInFlight[ids[j]] = 0;
+            }
+            throw std::invalid_argument("Gym_VectorEnv: env id " + std::to_string(id) +
+                                        " is out of range, repeated or still in flight");
+        }
+        mvEnvInFlight[id] = 1;
+    }
+    //Only now that no worker steps these envs
+    if ( act.defined() ) {
+        for ( size_t k=0; k<ids.size(); ++k ) {
+            mvActionRows[ids[k]].copy_(act[k]);
+        }
+    }
+
+    mvSendJobs.emplace_back();
+    Send_Job &job = mvSendJobs.back();
+    job.ids = std::move(ids);
+    job.finished.assign(job.ids.size(), 0);
+    job.reset = reset;
+    job.body = [this, &job](int k) {
+        const int i = job.ids[k];
+        try {
+            if ( job.reset ) {
+                mResetBody(i);
+                mvRewardRows[i].zero_();
+                mvDoneRows[i].zero_();
+            } else {
+                mStepBody(i);
+            }
+        } catch (...) {
+            signal_ready();     //recv() reaps the job and rethrows
+            throw;
+        }
+        job.finished[k] = 1;
+        mReady->try_push(i);     //never full, an env is queued at most once
+        signal_ready();
+    };
+    mInFlight += int(job.ids.size());
+    job.ticket = mPool.submit(int(job.ids.size()), job.body);
+}
+
+void Gym_VectorEnv::reap_sends(bool block)
+{
+    while ( !mvSendJobs.empty() ) {
+        try {
+            if ( block ) {
+                mPool.wait(mvSendJobs.front().ticket);
+            } else if ( !mPool.try_wait(mvSendJobs.front().ticket) ) {
+                return;
+            }
+        } catch (...) {
+            //The pool is done with the job: what did not finish never will
+            const Send_Job &job = mvSendJobs.front();
+            for ( size_t k=0; k<job.ids.size(); ++k ) {
+                if ( !job.finished[k] ) {
+                    mvEnvInFlight[job.ids[k]] = 0;
+                    --mInFlight;
+                }
+            }
+            mvSendJobs.pop_front();
+            throw;
+        }
+        mvSendJobs.pop_front();
+    }
+}
+
+void Gym_VectorEnv::reap_popped(int got)
+{
+    try {
+        reap_sends(false);
+    } catch (...) {
+        //Requeue the envs recv() already took, their steps did finish
+        const int64_t *pIds = mBatchIds.data_ptr<int64_t>();
+        for ( int k=0; k<got; ++k ) {
+            const int id = int(pIds[k]);
+            mvEnvInFlight[id] = 1;
+            ++mInFlight;
+            mReady->try_push(id);
+        }
+        throw;
+    }
+}
+
+void Gym_VectorEnv::signal_ready()
+{
+    {
+        std::lock_guard<std::mutex> lock(mReadyMutex);
+        ++mReadySignals;
+    }
+    mReadyWake.notify_one();
+}
+
+void Gym_VectorEnv::async_reset()
+{
+    check_idle("async_reset()");
+    std::vector<int> ids(env_count());
+    for ( int i=0; i<env_count(); ++i ) {
+        ids[i] = i;
+    }
+    dispatch(std::move(ids), torch::Tensor(), true);
+}
+
+void Gym_VectorEnv::send(at::Tensor action, at::Tensor envIds)
+{
+    const auto ids64 = envIds.to(torch::kLong).contiguous();
+    const int64_t *pIds = ids64.data_ptr<int64_t>();
+    std::vector<int> ids(pIds, pIds + ids64.numel());
+    dispatch(std::move(ids), action, false);
+}
+
+Gym_Torch::dType Gym_VectorEnv::recv()
+{
+    if ( mInFlight < mBatchSize ) {
+        throw std::logic_error("Gym_VectorEnv::recv() with fewer than batch_size() envs in flight");
+    }
+    int64_t *pIds = mBatchIds.data_ptr<int64_t>();
+    int got = 0;
+    int idle = 0;
+    while ( got < mBatchSize ) {
+        //Read before looking: a signal after this wakes the wait below
+        const uint64_t signals = mReadySignals.load();
+        int id;
+        if ( mReady->try_pop(id) ) {
+            mvEnvInFlight[id] = 0;
+            --mInFlight;
+            pIds[got++] = id;
+            idle = 0;
+            continue;
+        }
+        //Rethrows what a worker threw, instead of waiting for it forever
+        reap_popped(got);
+        //A short spin for envs about to finish, then sleep until one does
+        if ( ++idle > 64 ) {
+            std::unique_lock<std::mutex> lock(mReadyMutex);
+            mReadyWake.wait(lock, [&]{ return mReadySignals.load() != signals; });
+        }
+    }
+    reap_popped(got);
+
+    torch::index_select_out(mBatchState, mState, 0, mBatchIds);
+    torch::index_select_out(mBatchReward, mReward, 0, mBatchIds);
+    torch::index_select_out(mBatchDone, mDone, 0, mBatchIds);
+    return std::make_tuple<>(mBatchState, mBatchReward, mBatchDone, mBatchIds);
+}
+
+at::Tensor Gym_VectorEnv::reset()
+{
+    check_idle("reset()");
+    mPool.run(env_count(), mResetBody);
+    return mState;
+}
+
+Gym_Torch::dType Gym_VectorEnv::step(at::Tensor action)
+{
+    check_idle("step()");
+    if ( !action.is_same(mActions) ) {
+        mActions.copy_(action.view_as(mActions));
+    }
+    mPool.run(env_count(), mStepBody);
+    return std::make_tuple<>(mState, mReward, mDone, torch::Tensor());
+}
+
+at::Tensor Gym_VectorEnv::sample_action()
+{
+    check_idle("sample_action()");
+    mPool.run(env_count(), mSampleBody);
+    return mActions.clone();
+}
+
+int Gym_VectorEnv::action_dimension()
+{
+    return mvEnvs[0]->action_dimension();
+}
+
+int Gym_VectorEnv::state_dimension()
+{
+    return mvEnvs[0]->state_dimension();
+}
+
+void Gym_VectorEnv::seed(uint64_t seed, uint32_t envId)
+{
+    check_idle("seed()");
+    for ( auto &e : mvEnvs ) {
+        e->seed(seed, envId);
+        envId += e->env_ids();
+    }
+}
+
+uint32_t Gym_VectorEnv::env_ids() const
+{
+    uint32_t ids = 0;
+    for ( auto &e : mvEnvs ) {
+        ids += e->env_ids();
+    }
+    return ids;
+}
+
+int Gym_VectorEnv::env_count() const
+{
+    return int(mvEnvs.size());
+}
+
+int Gym_VectorEnv::worker_count() const
+{
+    return mPool.worker_count();
+}
+
+Gym_Torch& Gym_VectorEnv::env(int i)
+{
+    return *mvEnvs[i];
+}
+
+void Gym_VectorEnv::set_work_stealing(bool steal)
+{
+    mPool.set_work_stealing(steal);
+}
+
+bool Gym_VectorEnv::work_stealing() const
+{
+    return mPool.work_stealing();
+}
+
+std::vector<double> Gym_VectorEnv::worker_utilization() const
+{
+    return mPool.utilization();
+}
+
+void Gym_VectorEnv::reset_utilization()
+{
+    mPool.reset_utilization();
+}
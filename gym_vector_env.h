@@ -0,0 +1,304 @@
+#ifndef GYM_VECTOR_ENV_H
+#define GYM_VECTOR_ENV_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gym_queue.h"
+#include "gym_torch.h"
+
+/**
+ * Fixed set of worker threads running one function over an index range.
+ * A job splits [0, count) in contiguous chunks, chunk w goes to worker w.
+ * With work stealing on (the default) the chunk is the worker's deque: it
+ * takes indices from the front and, once it runs dry, steals the back half
+ * of another worker's deque, so one slow index (e.g. a rendering env) does
+ * not leave the other workers idle. Owners keep their own chunk as long as
+ * they keep up, so placement stays contiguous.
+ * Jobs are queued, every worker runs its chunks in submission order, so
+ * several jobs can be in flight. Each worker accounts the time it spends
+ * in chunks so the pool can be sized from utilization().
+ */
+class Gym_WorkerPool
+{
+public:
+    /**
+     * With a core map, worker w pins itself to core cores[w % cores.size()]
+     * before it runs anything, so memory it touches first is placed on that
+     * core's NUMA node (the default local allocation policy).
+     */
+    explicit Gym_WorkerPool(int workers, const std::vector<int> &cores = {});
+    ~Gym_WorkerPool();
+
+    Gym_WorkerPool(const Gym_WorkerPool&) = delete;
+    Gym_WorkerPool& operator=(const Gym_WorkerPool&) = delete;
+
+    int worker_count() const;
+
+    /**
+     * Queue body(i) for every i in [0, count) and return a ticket for wait().
+     * body must stay alive until then, and every ticket must be waited for.
+     */
+    uint64_t submit(int count, const std::function<void(int)> &body);
+    /** Block until the job is done; rethrows the first exception of a worker */
+    void wait(uint64_t ticket);
+    /** wait() if the job is done, otherwise return false at once */
+    bool try_wait(uint64_t ticket);
+    /** submit() and wait() */
+    void run(int count, const std::function<void(int)> &body);
+
+    /** Applies to jobs submitted afterwards */
+    void set_work_stealing(bool steal);
+    bool work_stealing() const;
+
+    /** Busy fraction of each worker since construction or reset_utilization() */
+    std::vector<double> utilization() const;
+    void reset_utilization();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    //One cache line per worker, written only by that worker
+    struct alignas(64) Worker_Stats
+    {
+        std::atomic<int64_t> busyNs{0};
+    };
+
+    //Deque of a job's indices of one worker, head << 32 | tail, taken by
+    //compare-exchange of the whole value from both ends
+    struct alignas(64) Worker_Range
+    {
+        std::atomic<uint64_t> span;
+    };
+
+    struct Job
+    {
+        const std::function<void(int)> *body;
+        bool steal;
+        int pending;    //workers yet to finish their chunk
+        bool waited;
+        std::exception_ptr error;
+        std::unique_ptr<Worker_Range[]> ranges;
+    };
+
+    void worker_loop(int w, int core);
+    static bool take_front(Worker_Range &range, int &i);
+    bool steal(Worker_Range *ranges, int w, int &i) const;
+
+    std::vector<std::thread> mvThreads;
+    std::unique_ptr<Worker_Stats[]> mStats;
+    std::atomic<int64_t> mStatsSinceNs;
+
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::condition_variable mDone;
+    //Job with ticket t is mJobs[t - mFirstTicket]
+    std::deque<Job> mJobs;
+    uint64_t mFirstTicket = 0;
+    bool mStop = false;
+    bool mSteal = true;
+};
+
+/**
+ * N environments (any single Gym_Torch env, env_ids() == 1, with equal
+ * state and action dimensions) stepped on a Gym_WorkerPool. Each worker owns
+ * a contiguous range of envs and writes their rows of the stacked
+ * [N, state_dimension()] state, [N] reward and [N] done tensors. These
+ * tensors are reused by every call, as are the tensors of the single
+ * environments. Each worker zeroes its own rows first, so with pinned
+ * workers they are on the worker's node.
+ *
+ * Results do not depend on the number of workers or on scheduling: each
+ * env only ever runs on one thread at a time, draws its randomness from
+ * (seed, env id, episode, step) (see gym_rng.h) and no arithmetic is shared
+ * between envs. The constructors seed the envs from one draw of the torch
+ * generator; seed() picks the seed and env i gets env id envId + i. The
+ * same seed gives the same per-env trajectories with 1 or 64 workers
+ * (gym_bench checks 1, 4 and 32).
+ * Only the order in which recv() hands out envs depends on timing.
+ *
+ * The envs can also be split in contiguous groups that step asynchronously:
+ * step_async(action, g) queues group g and returns, step_wait(g) returns its
+ * rows. With two groups, policy inference for one group overlaps with the
+ * simulation of the other:
+ *
+ *     vec.step_async(policy(s0), 0);
+ *     vec.step_async(policy(s1), 1);
+ *     for (;;) {
+ *         s0 = std::get<0>(vec.step_wait(0)); vec.step_async(policy(s0), 0);
+ *         s1 = std::get<0>(vec.step_wait(1)); vec.step_async(policy(s1), 1);
+ *     }
+ *
+ * First-M-of-N mode (as in envpool): send(action, ids) starts steps of any
+ * envs and recv() returns the first batch_size() envs that finished, with
+ * their ids, while the slower ones keep running:
+ *
+ *     vec.set_batch_size(M);
+ *     vec.async_reset();
+ *     for (;;) {
+ *         auto [s, r, d, ids] = vec.recv();
+ *         vec.send(policy(s), ids);
+ *     }
+ */
+class Gym_VectorEnv : public Gym_Torch
+{
+public:
+    /** workers = 0 uses one worker per hardware thread */
+    Gym_VectorEnv(std::vector<std::unique_ptr<Gym_Torch>> envs, int workers = 0,
+                  torch::ScalarType stateType = torch::kFloat);
+
+    using Factory = std::function<std::unique_ptr<Gym_Torch>(int envIndex)>;
+
+    /**
+     * One worker per entry of the core map, pinned to that core (an empty map
+     * gives one unpinned worker per hardware thread). Env i is built by
+     * factory(i) on the worker that steps it, so its state and frame stack
+     * are allocated on that worker's node too. factory must be thread safe.
+     * With a core map work stealing starts off: a stolen env is stepped by a
+     * worker on another node, losing the placement. set_work_stealing(true)
+     * trades that locality back for load balance across uneven envs.
+     */
+    Gym_VectorEnv(const Factory &factory, int envs, const std::vector<int> &cores,
+                  torch::ScalarType stateType = torch::kFloat);
+    virtual ~Gym_VectorEnv();
+
+    // Gym_Torch interface
+    virtual torch::Tensor reset() override;
+    virtual dType step(torch::Tensor action) override;
+    virtual torch::Tensor sample_action() override;
+    virtual int action_dimension() override;
+    virtual int state_dimension() override;
+    //Env i is seeded as env id envId + env_ids() of envs 0 .. i-1
+    virtual void seed(uint64_t seed, uint32_t envId = 0) override;
+    virtual uint32_t env_ids() const override;
+
+    /**
+     * Split the envs in `groups` contiguous groups of (nearly) equal size.
+     * Not allowed while a group is in flight.
+     */
+    void set_groups(int groups);
+    int group_count() const;
+    int group_begin(int group) const;
+    int group_size(int group) const;
+
+    /**
+     * Queue a step of the group with action [group_size(group), action_dimension()].
+     * Not allowed while any env of the group is in flight through send().
+     */
+    void step_async(torch::Tensor action, int group = 0);
+    /** Wait for the group's step; the tensors are the group's rows of the stacked ones */
+    dType step_wait(int group = 0);
+
+    /** Rows returned by recv(), 1 to env_count(); not while envs are in flight */
+    void set_batch_size(int batchSize);
+    int batch_size() const;
+    /** Reset all envs in the background, each becomes ready for recv() */
+    void async_reset();
+    /**
+     * Step envs envIds ([k] long) with action [k, action_dimension()] in the
+     * background. Not allowed while a group is stepping. When an env throws,
+     * the exception comes out of a later send()/recv() and the envs of that
+     * send() that did not finish are no longer in flight; envs that did finish
+     * stay ready for the next recv(). Ids are checked before any action row is
+     * written, so a rejected send() leaves the running envs alone.
+     */
+    void send(torch::Tensor action, torch::Tensor envIds);
+    /**
+     * Block until batch_size() envs are ready and return their [M, state]
+     * states, [M] rewards and dones, and [M] long env ids (the reserved slot).
+     * Envs are handed out in the order they finished; the tensors are reused.
+     */
+    dType recv();
+
+    int env_count() const;
+    int worker_count() const;
+    Gym_Torch& env(int i);
+
+    //See Gym_WorkerPool::set_work_stealing()
+    void set_work_stealing(bool steal);
+    bool work_stealing() const;
+
+    //See Gym_WorkerPool::utilization()
+    std::vector<double> worker_utilization() const;
+    void reset_utilization();
+
+protected:
+    std::vector<std::unique_ptr<Gym_Torch>> mvEnvs;
+    Gym_WorkerPool mPool;
+
+    torch::Tensor mActions;
+    torch::Tensor mReward;
+    torch::Tensor mDone;
+
+    //Row views of the tensors above, made once so that stepping creates none
+    std::vector<torch::Tensor> mvActionRows;
+    std::vector<torch::Tensor> mvStateRows;
+    std::vector<torch::Tensor> mvRewardRows;
+    std::vector<torch::Tensor> mvDoneRows;
+
+    std::function<void(int)> mResetBody;
+    std::function<void(int)> mStepBody;
+    std::function<void(int)> mSampleBody;
+
+    struct Env_Group
+    {
+        int begin;
+        int size;
+        torch::Tensor actions;
+        torch::Tensor state;
+        torch::Tensor reward;
+        torch::Tensor done;
+        std::function<void(int)> stepBody;
+        bool inFlight;
+        uint64_t ticket;
+    };
+
+    void check_idle(const char *call) const;
+    void init_buffers(torch::ScalarType stateType);
+    //body(i) on the worker that owns env i in static chunks
+    void run_owned(int count, const std::function<void(int)> &body);
+
+    std::vector<Env_Group> mvGroups;
+
+    //First-M-of-N mode
+    struct Send_Job
+    {
+        std::vector<int> ids;
+        std::vector<uint8_t> finished;  //ids[k] was queued in mReady
+        bool reset;
+        std::function<void(int)> body;
+        uint64_t ticket;
+    };
+
+    void dispatch(std::vector<int> ids, const torch::Tensor &action, bool reset);
+    //Waits for send jobs that are done (all of them with block = true). A job
+    //that threw takes its unfinished envs out of flight before rethrowing.
+    void reap_sends(bool block);
+    //reap_sends(false) for recv(): on a throw the `got` envs it popped go back to mReady
+    void reap_popped(int got);
+    //Wakes recv(), after an env was queued in mReady or a send job threw
+    void signal_ready();
+
+    int mBatchSize = 0;
+    int mInFlight = 0;                  //sent but not handed out by recv()
+    std::vector<uint8_t> mvEnvInFlight;
+    std::deque<Send_Job> mvSendJobs;    //stable addresses, the pool holds &body
+    std::unique_ptr<Gym_MpscQueue<int>> mReady;
+    std::mutex mReadyMutex;
+    std::condition_variable mReadyWake;
+    std::atomic<uint64_t> mReadySignals{0};
+    torch::Tensor mBatchState;
+    torch::Tensor mBatchReward;
+    torch::Tensor mBatchDone;
+    torch::Tensor mBatchIds;
+};
+
+#endif // GYM_VECTOR_ENV_H